@@ -0,0 +1,161 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Microbenchmarks for the hot paths of bcache-tools: crc64() over buffers
+ * from 4K to 1G, csum_set() on an on-disk superblock, and the
+ * to_cache_sb()/to_cache_sb_disk() conversions and the head-only decode
+ * used when listing.
+ *
+ * Output is one tab separated record per measurement, preceded by a
+ * header line, so results can be collected and compared across releases:
+ *
+ *	bench	bytes	iters	ns_per_op	gb_per_s
+ *
+ * An optional argument caps the largest crc64 buffer, in bytes.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bcache.h"
+#include "lib.h"
+#include "bitwise.h"
+
+#define BENCH_MAX_SIZE		(1ULL << 30)
+#define BENCH_CRC_BYTES		(1ULL << 30)	/* per crc64 data point */
+#define BENCH_SB_ITERS		1000000
+
+static volatile uint64_t bench_sink;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void report(const char *bench, uint64_t bytes, uint64_t iters,
+		   uint64_t ns)
+{
+	double per_op = (double) ns / iters;
+
+	printf("%s\t%" PRIu64 "\t%" PRIu64 "\t%.1f\t%.3f\n",
+	       bench, bytes, iters, per_op, bytes / per_op);
+}
+
+static void bench_crc64(unsigned char *buf, uint64_t max_size)
+{
+	static const uint64_t sizes[] = {
+		4ULL << 10, 64ULL << 10, 1ULL << 20, 16ULL << 20,
+		256ULL << 20, 1ULL << 30,
+	};
+	uint64_t iters, i, start;
+	unsigned int s;
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		if (sizes[s] > max_size)
+			break;
+
+		iters = BENCH_CRC_BYTES / sizes[s];
+		if (!iters)
+			iters = 1;
+
+		start = now_ns();
+		for (i = 0; i < iters; i++)
+			bench_sink ^= crc64(buf, sizes[s]);
+		report("crc64", sizes[s], iters, now_ns() - start);
+	}
+}
+
+static void fill_sb(struct cache_sb *sb)
+{
+	int i;
+
+	memset(sb, 0, sizeof(*sb));
+	sb->offset = SB_SECTOR;
+	sb->version = BCACHE_SB_VERSION_CDEV_WITH_UUID;
+	memcpy(sb->magic, bcache_magic, 16);
+	for (i = 0; i < 16; i++) {
+		sb->uuid[i] = i;
+		sb->set_uuid[i] = 0xff - i;
+	}
+	sb->block_size = 8;
+	sb->bucket_size = 1024;
+	sb->nbuckets = 1 << 20;
+	sb->nr_in_set = 1;
+	sb->first_bucket = 1;
+	sb->keys = SB_JOURNAL_BUCKETS;
+	for (i = 0; i < SB_JOURNAL_BUCKETS; i++)
+		sb->d[i] = sb->first_bucket + i;
+}
+
+static void bench_sb(void)
+{
+	struct cache_sb_disk sb_disk;
+	struct cache_sb sb;
+	uint64_t i, start;
+
+	fill_sb(&sb);
+	to_cache_sb_disk(&sb_disk, &sb);
+
+	start = now_ns();
+	for (i = 0; i < BENCH_SB_ITERS; i++) {
+		sb_disk.seq = i;
+		bench_sink ^= csum_set(&sb_disk);
+	}
+	report("csum_set", ((void *) end(&sb_disk)) - ((void *) &sb_disk) - 8,
+	       BENCH_SB_ITERS, now_ns() - start);
+
+	start = now_ns();
+	for (i = 0; i < BENCH_SB_ITERS; i++) {
+		sb_disk.seq = i;
+		to_cache_sb(&sb, &sb_disk);
+		to_cache_sb_disk(&sb_disk, &sb);
+		bench_sink ^= sb.seq;
+	}
+	report("sb_roundtrip", sizeof(sb_disk), BENCH_SB_ITERS,
+	       now_ns() - start);
+
+	start = now_ns();
+	for (i = 0; i < BENCH_SB_ITERS; i++) {
+		sb_disk.seq = i;
+		to_cache_sb_head(&sb, &sb_disk);
+		bench_sink ^= sb.seq;
+	}
+	report("sb_decode_head", sizeof(sb_disk), BENCH_SB_ITERS,
+	       now_ns() - start);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t max_size = BENCH_MAX_SIZE;
+	unsigned char *buf;
+	uint64_t i;
+
+	if (argc > 1)
+		max_size = strtoull(argv[1], NULL, 0);
+
+	/* Benchmark whatever fits if a 1G buffer can't be had */
+	while ((buf = malloc(max_size)) == NULL && max_size > 4096)
+		max_size >>= 1;
+	if (buf == NULL) {
+		fprintf(stderr, "Error: fail to allocate benchmark buffer\n");
+		return 1;
+	}
+	for (i = 0; i < max_size; i++)
+		buf[i] = i * 131 + (i >> 12);
+
+	printf("bench\tbytes\titers\tns_per_op\tgb_per_s\n");
+	bench_crc64(buf, max_size);
+	bench_sb();
+
+	free(buf);
+	return 0;
+}
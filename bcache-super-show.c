@@ -28,6 +28,29 @@
 #include "lib.h"
 #include "bitwise.h"
 
+/*
+ * Journal buckets as runs, "1-64" for a contiguous journal. 0 buckets
+ * means the kernel hasn't laid the journal out yet.
+ */
+static void print_journal(struct cache_sb *sb)
+{
+	unsigned int i, j;
+
+	printf("dev.cache.journal_buckets\t%u\n", sb->keys);
+	if (!sb->keys || sb->keys > SB_JOURNAL_BUCKETS)
+		return;
+
+	printf("dev.cache.journal\t");
+	for (i = 0; i < sb->keys; i = j) {
+		for (j = i + 1; j < sb->keys && sb->d[j] == sb->d[j - 1] + 1; j++)
+			;
+		printf("%s%ju", i ? "," : "", (uintmax_t) sb->d[i]);
+		if (j - i > 1)
+			printf("-%ju", (uintmax_t) sb->d[j - 1]);
+	}
+	putchar('\n');
+}
+
 static void usage()
 {
 	fprintf(stderr, "Usage: bcache-super-show [-f] <device>\n");
@@ -176,6 +199,7 @@ int main(int argc, char **argv)
 			default:
 				putchar('\n');
 		}
+		print_journal(&sb);
 
 	} else {
 		uint64_t first_sector;
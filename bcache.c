@@ -16,10 +16,12 @@
 #include <locale.h>
 #include "list.h"
 #include <limits.h>
-#include <assert.h>
 
 #include "features.h"
 #include "show.h"
+#include "csum.h"
+#include "sbcache.h"
+#include "libbcache.h"
 
 #define BCACHE_TOOLS_VERSION	"1.1"
 
@@ -81,7 +83,9 @@ int main_usage(void)
 		"	attach		attach backend device(data device) to cache device\n"
 		"	detach		detach backend device(data device) from cache device\n"
 		"	set-cachemode	set cachemode for backend device\n"
-		"	set-label	set label for backend device\n");
+		"	set-label	set label for backend device\n"
+		"	resize		grow a device's superblock to a resized device\n"
+		"	csum-map	checksum cache device buckets and report changes\n");
 	return EXIT_FAILURE;
 }
 
@@ -92,6 +96,8 @@ int show_usage(void)
 		"	show overall information about all devices\n"
 		"	-d	--device {devname}	show the detail infomation about this device\n"
 		"	-m	--more			show overall information about all devices with detail info\n"
+		"	-r	--rescan		read every device instead of using " SBCACHE_PATH "\n"
+		"	-f	--format {fmt}		output format: text (default), json or ndjson\n"
 		"	-h	--help			show help information\n");
 	return EXIT_FAILURE;
 }
@@ -99,7 +105,8 @@ int show_usage(void)
 int tree_usage(void)
 {
 	fprintf(stderr,
-		"Usage: tree	show active bcache devices in this host\n");
+		"Usage: tree [--rescan] [--format text|json|ndjson]\n"
+		"	show active bcache devices in this host\n");
 	return EXIT_FAILURE;
 }
 
@@ -142,118 +149,36 @@ int setlabel_usage(void)
 	return EXIT_FAILURE;
 }
 
-int version_usagee(void)
+int resize_usage(void)
 {
 	fprintf(stderr,
-		"Usage: version		display software version\n");
+		"Usage:resize devicename\n"
+		"(the device must not be registered; cache devices can only grow)\n");
 	return EXIT_FAILURE;
 }
 
-void replace_line(char **dest, const char *from, const char *to)
+int version_usagee(void)
 {
-	assert(strlen(from) == strlen(to));
-	char sub[4096] = "";
-	char new[4096] = "";
-
-	strcpy(sub, *dest);
-	while (1) {
-		char *tmp = strpbrk(sub, from);
-
-		if (tmp != NULL) {
-			strcpy(new, tmp);
-			strcpy(sub, tmp + strlen(from));
-		} else
-			break;
-	}
-	if (strlen(new) > 0) {
-		strncpy(new, to, strlen(to));
-		sprintf(*dest + strlen(*dest) - strlen(new), new, strlen(new));
-	}
+	fprintf(stderr,
+		"Usage: version		display software version\n");
+	return EXIT_FAILURE;
 }
 
-int tree(void)
+static int parse_format(const char *arg, enum show_format *format)
 {
-	char *out;
-	const char *begin = ".\n";
-	const char *middle = "├─";
-	const char *tail = "└─";
-	struct list_head head;
-	struct dev *devs, *tmp, *n, *m;
-
-	INIT_LIST_HEAD(&head);
-	int ret;
-
-	out = (char *)malloc(4096);
-	if (out == NULL) {
-		fprintf(stderr, "Error: fail to allocate memory buffer\n");
+	if (strcmp(arg, "text") == 0)
+		*format = SHOW_FORMAT_TEXT;
+	else if (strcmp(arg, "json") == 0)
+		*format = SHOW_FORMAT_JSON;
+	else if (strcmp(arg, "ndjson") == 0)
+		*format = SHOW_FORMAT_NDJSON;
+	else {
+		fprintf(stderr, "Unknown output format %s\n", arg);
 		return 1;
 	}
-
-	ret = list_bdevs(&head);
-	if (ret != 0) {
-		free(out);
-		fprintf(stderr, "Failed to list devices\n");
-		return ret;
-	}
-	sprintf(out, "%s", begin);
-	list_for_each_entry_safe(devs, n, &head, dev_list) {
-		if ((devs->version == BCACHE_SB_VERSION_CDEV
-		     || devs->version == BCACHE_SB_VERSION_CDEV_WITH_UUID)
-		    && strcmp(devs->state, BCACHE_BASIC_STATE_ACTIVE) == 0) {
-			sprintf(out + strlen(out), "%s\n", devs->name);
-			list_for_each_entry_safe(tmp, m, &head, dev_list) {
-				if (strcmp(devs->cset, tmp->attachuuid) ==
-				    0) {
-					replace_line(&out, tail, middle);
-					sprintf(out + strlen(out), "%s%s %s\n",
-						tail, tmp->name, tmp->bname);
-				}
-			}
-		}
-	}
-	if (strlen(out) > strlen(begin))
-		printf("%s", out);
-	free_dev(&head);
-	free(out);
 	return 0;
 }
 
-int attach_both(char *cdev, char *backdev)
-{
-	struct bdev bd;
-	struct cdev cd;
-	int type = 1;
-	int ret;
-	char buf[100];
-
-	ret = detail_dev(backdev, &bd, &cd, &type);
-	if (ret != 0)
-		return ret;
-	if (type != BCACHE_SB_VERSION_BDEV
-	    && type != BCACHE_SB_VERSION_BDEV_WITH_OFFSET) {
-		fprintf(stderr, "%s is not an backend device\n", backdev);
-		return 1;
-	}
-	if (strcmp(bd.base.attachuuid, BCACHE_BNAME_NOT_EXIST) != 0) {
-		fprintf(stderr,
-			"This device have attached to another cset\n");
-		return 1;
-	}
-
-	if (strlen(cdev) != 36) {
-		ret = detail_dev(cdev, &bd, &cd, &type);
-		if (type != BCACHE_SB_VERSION_CDEV
-		    && type != BCACHE_SB_VERSION_CDEV_WITH_UUID) {
-			fprintf(stderr, "%s is not an cache device\n", cdev);
-			return 1;
-		}
-		strcpy(buf, cd.base.cset);
-	} else {
-		strcpy(buf, cdev);
-	}
-	return attach_backdev(buf, backdev);
-}
-
 bool has_permission(void)
 {
 	uid_t euid = geteuid();
@@ -282,22 +207,28 @@ int main(int argc, char **argv)
 	char *devname = NULL;
 	if (strcmp(subcmd, "make") == 0)
 		return make_bcache(argc, argv);
+	else if (strcmp(subcmd, "csum-map") == 0)
+		return csum_map(argc, argv);
 	else if (strcmp(subcmd, "show") == 0) {
 		int o = 0;
 		int more = 0;
 		int device = 0;
 		int help = 0;
+		unsigned int flags = 0;
+		enum show_format format = SHOW_FORMAT_TEXT;
 
 		static struct option long_options[] = {
 			{"more", no_argument, 0, 'm'},
 			{"help", no_argument, 0, 'h'},
 			{"device", required_argument, 0, 'd'},
+			{"rescan", no_argument, 0, 'r'},
+			{"format", required_argument, 0, 'f'},
 			{0, 0, 0, 0}
 		};
 		int option_index = 0;
 
 		while ((o =
-			getopt_long(argc, argv, "hmd:", long_options,
+			getopt_long(argc, argv, "hmd:rf:", long_options,
 				    &option_index)) != EOF) {
 			switch (o) {
 			case 'd':
@@ -307,6 +238,13 @@ int main(int argc, char **argv)
 			case 'm':
 				more = 1;
 				break;
+			case 'r':
+				flags |= LIST_BDEVS_RESCAN;
+				break;
+			case 'f':
+				if (parse_format(optarg, &format))
+					return 1;
+				break;
 			case 'h':
 				help = 1;
 				break;
@@ -318,21 +256,54 @@ int main(int argc, char **argv)
 		if (help || argc != 0) {
 			return show_usage();
 		} else if (more) {
-			return show_bdevs_detail();
+			if (format != SHOW_FORMAT_TEXT)
+				return show_bdevs_json(flags, format, true);
+			return show_bdevs_detail(flags);
 		} else if (device) {
 			if (bad_dev(&devname)) {
 				fprintf(stderr,
 					"Error:Wrong device name found\n");
 				return 1;
 			}
+			if (format != SHOW_FORMAT_TEXT)
+				return detail_single_json(devname, format);
 			return detail_single(devname);
 		} else {
-			return show_bdevs();
+			if (format != SHOW_FORMAT_TEXT)
+				return show_bdevs_json(flags, format, false);
+			return show_bdevs(flags);
 		}
 	} else if (strcmp(subcmd, "tree") == 0) {
-		if (argc != 1)
+		int o;
+		unsigned int flags = 0;
+		enum show_format format = SHOW_FORMAT_TEXT;
+
+		static struct option long_options[] = {
+			{"rescan", no_argument, 0, 'r'},
+			{"format", required_argument, 0, 'f'},
+			{"help", no_argument, 0, 'h'},
+			{0, 0, 0, 0}
+		};
+
+		while ((o = getopt_long(argc, argv, "rf:h", long_options,
+					NULL)) != EOF) {
+			switch (o) {
+			case 'r':
+				flags |= LIST_BDEVS_RESCAN;
+				break;
+			case 'f':
+				if (parse_format(optarg, &format))
+					return 1;
+				break;
+			default:
+				return tree_usage();
+			}
+		}
+		if (argc != optind)
 			return tree_usage();
-		return tree();
+		if (format != SHOW_FORMAT_TEXT)
+			return tree_json(flags, format);
+		return tree(flags);
 	} else if (strcmp(subcmd, "register") == 0) {
 		if (argc != 2 || strcmp(argv[1], "-h") == 0)
 			return register_usage();
@@ -341,7 +312,7 @@ int main(int argc, char **argv)
 			fprintf(stderr, "Error:Wrong device name found\n");
 			return 1;
 		}
-		return register_dev(devname);
+		return bcache_register(devname) ? EXIT_FAILURE : 0;
 	} else if (strcmp(subcmd, "unregister") == 0) {
 		if (argc != 2 || strcmp(argv[1], "-h") == 0)
 			return unregister_usage();
@@ -350,21 +321,7 @@ int main(int argc, char **argv)
 			fprintf(stderr, "Error:Wrong device name found\n");
 			return 1;
 		}
-		struct bdev bd;
-		struct cdev cd;
-		int type = 1;
-		int ret;
-
-		ret = detail_dev(devname, &bd, &cd, &type);
-		if (ret != 0)
-			return ret;
-		if (type == BCACHE_SB_VERSION_BDEV) {
-			return stop_backdev(devname);
-		} else if (type == BCACHE_SB_VERSION_CDEV
-			   || type == BCACHE_SB_VERSION_CDEV_WITH_UUID) {
-			return unregister_cset(cd.base.cset);
-		}
-		return 1;
+		return bcache_unregister(devname) ? EXIT_FAILURE : 0;
 	} else if (strcmp(subcmd, "attach") == 0) {
 		if (argc != 3 || strcmp(argv[1], "-h") == 0)
 			return attach_usage();
@@ -377,7 +334,7 @@ int main(int argc, char **argv)
 			"Error:Wrong device name or cache_set uuid found\n");
 			return 1;
 		}
-		return attach_both(attachto, devname);
+		return bcache_attach(attachto, devname) ? EXIT_FAILURE : 0;
 	} else if (strcmp(subcmd, "detach") == 0) {
 		if (argc != 2 || strcmp(argv[1], "-h") == 0)
 			return detach_usage();
@@ -386,7 +343,7 @@ int main(int argc, char **argv)
 			fprintf(stderr, "Error:Wrong device name found\n");
 			return 1;
 		}
-		return detach_backdev(devname);
+		return bcache_detach(devname) ? EXIT_FAILURE : 0;
 	} else if (strcmp(subcmd, "set-cachemode") == 0) {
 		if (argc != 3)
 			return setcachemode_usage();
@@ -395,24 +352,7 @@ int main(int argc, char **argv)
 			fprintf(stderr, "Error:Wrong device name found\n");
 			return 1;
 		}
-		struct bdev bd;
-		struct cdev cd;
-		int type = 1;
-		int ret;
-
-		ret = detail_dev(devname, &bd, &cd, &type);
-		if (ret != 0) {
-			fprintf(stderr,
-			"This device doesn't exist or failed to receive info from this device\n");
-			return ret;
-		}
-		if (type != BCACHE_SB_VERSION_BDEV
-		    && type != BCACHE_SB_VERSION_BDEV_WITH_OFFSET) {
-			fprintf(stderr,
-				"Only backend device is suppported\n");
-			return 1;
-		}
-		return set_backdev_cachemode(devname, argv[2]);
+		return bcache_set_cachemode(devname, argv[2]) ? EXIT_FAILURE : 0;
 	} else if (strcmp(subcmd, "set-label") == 0) {
 		if (argc != 3)
 			return setlabel_usage();
@@ -421,28 +361,16 @@ int main(int argc, char **argv)
 			fprintf(stderr, "Error:Wrong device name found\n");
 			return 1;
 		}
-		struct bdev bd;
-		struct cdev cd;
-		int type = 5;
-		int ret;
-
-		ret = detail_dev(devname, &bd, &cd, &type);
-		if (ret != 0) {
-			fprintf(stderr,
-		"This device doesn't exist or failed to receive info from this device\n");
-			return ret;
-		}
-		if (type != BCACHE_SB_VERSION_BDEV
-		    && type != BCACHE_SB_VERSION_BDEV_WITH_OFFSET) {
-			fprintf(stderr,
-				"Only backend device is suppported\n");
-			return 1;
-		}
-		if (strlen(argv[2]) >= SB_LABEL_SIZE) {
-			fprintf(stderr, "Label is too long\n");
+		return bcache_set_label(devname, argv[2]) ? EXIT_FAILURE : 0;
+	} else if (strcmp(subcmd, "resize") == 0) {
+		if (argc != 2 || strcmp(argv[1], "-h") == 0)
+			return resize_usage();
+		devname = argv[1];
+		if (bad_dev(&devname)) {
+			fprintf(stderr, "Error:Wrong device name found\n");
 			return 1;
 		}
-		return set_label(devname, argv[2]);
+		return resize_bcache(devname);
 	} else if (strcmp(subcmd, "version") == 0) {
 		if (argc != 1)
 			return version_usagee();
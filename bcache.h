@@ -43,6 +43,7 @@ static const char bcache_magic[] = {
 #define SB_SECTOR		8
 #define SB_LABEL_SIZE		32
 #define SB_JOURNAL_BUCKETS	256U
+#define MAX_CACHES_PER_SET	8
 #define BDEV_DATA_START_DEFAULT	16	/* sectors */
 #define SB_START		(SB_SECTOR * 512)
 
@@ -186,6 +187,8 @@ BITMASK(BDEV_STATE,		struct cache_sb, flags, 61, 2);
 #define BDEV_STATE_STALE	3U
 
 uint64_t crc64(const void *data, size_t len);
+uint64_t crc64_update(uint64_t crc, const void *data, size_t len);
+uint64_t crc64_combine(uint64_t crc_a, uint64_t crc_b, size_t len_b);
 
 #define node(i, j)		((void *) ((i)->d + (j)))
 #define end(i)			node(i, (i)->keys)
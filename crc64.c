@@ -1,8 +1,10 @@
 #define _GNU_SOURCE
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 
 /*
@@ -165,12 +167,49 @@ static const uint64_t crc64table[256] = {
 	0xd80c07cd676f8394ULL, 	0x9afce626ce85b507ULL,
 };
 
+/*
+ * crc64_slice[k][i] is the CRC of byte i followed by k zero bytes, so eight
+ * message bytes can be folded into the CRC with eight independent lookups
+ * instead of a serial chain of eight. crc64_slice[0] is crc64table itself;
+ * the other tables are derived from it once at startup.
+ */
+static uint64_t crc64_slice[8][256];
+
+static void crc64_init_slice_tables(void)
+{
+	int i, k;
+
+	for (i = 0; i < 256; i++)
+		crc64_slice[0][i] = crc64table[i];
+
+	for (k = 1; k < 8; k++)
+		for (i = 0; i < 256; i++)
+			crc64_slice[k][i] =
+				crc64table[crc64_slice[k - 1][i] >> 56] ^
+				(crc64_slice[k - 1][i] << 8);
+}
+
+/* Load 8 bytes as a big-endian value, the first byte ending up on top */
+static inline uint64_t load_be64(const unsigned char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
 /**
  * crc64_be - Calculate bitwise big-endian ECMA-182 CRC64
  * @crc: seed value for computation. 0 or (u64)~0 for a new CRC calculation,
         or the previous crc64 value if computing incrementally.
  * @p: pointer to buffer over which CRC64 is run
  * @len: length of buffer @p
+ *
+ * The bulk of the buffer is processed 8 bytes at a time (slice-by-8), the
+ * head and tail one byte at a time exactly as the kernel's crc64_be() does.
  */
 static uint64_t crc64_be(uint64_t crc, const void *p, size_t len)
 {
@@ -178,6 +217,18 @@ static uint64_t crc64_be(uint64_t crc, const void *p, size_t len)
 
         const unsigned char *_p = p;
 
+        for (; len >= 8; len -= 8, _p += 8) {
+                crc ^= load_be64(_p);
+                crc = crc64_slice[7][crc >> 56] ^
+                      crc64_slice[6][(crc >> 48) & 0xFF] ^
+                      crc64_slice[5][(crc >> 40) & 0xFF] ^
+                      crc64_slice[4][(crc >> 32) & 0xFF] ^
+                      crc64_slice[3][(crc >> 24) & 0xFF] ^
+                      crc64_slice[2][(crc >> 16) & 0xFF] ^
+                      crc64_slice[1][(crc >> 8) & 0xFF] ^
+                      crc64_slice[0][crc & 0xFF];
+        }
+
         for (i = 0; i < len; i++) {
                 t = ((crc >> 56) ^ (*_p++)) & 0xFF;
                 crc = crc64table[t] ^ (crc << 8);
@@ -186,10 +237,303 @@ static uint64_t crc64_be(uint64_t crc, const void *p, size_t len)
         return crc;
 }
 
-uint64_t crc64(const void *data, size_t len)
+/*
+ * Carry-less multiply folding, following Intel's "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction" white paper.
+ *
+ * The input is loaded 16 bytes at a time in big-endian order, so that a
+ * 128-bit lane A = H * x^64 + L holds the message bits in the same order
+ * the table path consumes them. Moving A forward by d bits of message is
+ *
+ *	A * x^d = H * (x^(d + 64) mod P) + L * (x^d mod P)
+ *
+ * which is two 64x64 carry-less multiplies producing at most 127 bits, so
+ * the lane never grows. Four lanes are folded 512 bits at a time, merged
+ * into one, and the final 128-bit remainder is reduced by running it
+ * through the table path, which also handles the unaligned tail.
+ */
+#define CRC64_POLY	0x42F0E1EBA9EA3693ULL
+
+static uint64_t crc64_fold_512_hi, crc64_fold_512_lo;
+static uint64_t crc64_fold_128_hi, crc64_fold_128_lo;
+
+/* x^n mod P */
+static uint64_t crc64_xpow_mod(unsigned int n)
+{
+	uint64_t r = 1;
+
+	while (n--)
+		r = (r << 1) ^ ((r >> 63) ? CRC64_POLY : 0);
+	return r;
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+#define CRC64_HAVE_CLMUL
+#define CLMUL_TARGET	__attribute__((target("pclmul,ssse3")))
+
+typedef __m128i v128;
+
+static inline CLMUL_TARGET v128 v128_load_be(const unsigned char *p)
+{
+	const __m128i rev = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+					 8, 9, 10, 11, 12, 13, 14, 15);
+
+	return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) p), rev);
+}
+
+static inline CLMUL_TARGET v128 v128_make(uint64_t hi, uint64_t lo)
+{
+	return _mm_set_epi64x(hi, lo);
+}
+
+static inline CLMUL_TARGET uint64_t v128_hi(v128 a)
+{
+	return _mm_cvtsi128_si64(_mm_unpackhi_epi64(a, a));
+}
+
+static inline CLMUL_TARGET uint64_t v128_lo(v128 a)
+{
+	return _mm_cvtsi128_si64(a);
+}
+
+static inline CLMUL_TARGET v128 v128_xor(v128 a, v128 b)
+{
+	return _mm_xor_si128(a, b);
+}
+
+/* hi(a) * khi ^ lo(a) * klo */
+static inline CLMUL_TARGET v128 v128_fold(v128 a, uint64_t khi, uint64_t klo)
+{
+	v128 k = _mm_set_epi64x(khi, klo);
+
+	return _mm_xor_si128(_mm_clmulepi64_si128(a, k, 0x11),
+			     _mm_clmulepi64_si128(a, k, 0x00));
+}
+
+static bool crc64_cpu_has_clmul(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul") &&
+	       __builtin_cpu_supports("ssse3");
+}
+
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+
+#define CRC64_HAVE_CLMUL
+#define CLMUL_TARGET	__attribute__((target("+crypto")))
+
+/* lane 1 is the high half, lane 0 the low half */
+typedef uint64x2_t v128;
+
+static inline CLMUL_TARGET v128 v128_load_be(const unsigned char *p)
+{
+	v128 v = vreinterpretq_u64_u8(vrev64q_u8(vld1q_u8(p)));
+
+	return vextq_u64(v, v, 1);
+}
+
+static inline CLMUL_TARGET v128 v128_make(uint64_t hi, uint64_t lo)
 {
-	uint64_t crc = 0xFFFFFFFFFFFFFFFFULL;
+	return vcombine_u64(vcreate_u64(lo), vcreate_u64(hi));
+}
+
+static inline CLMUL_TARGET uint64_t v128_hi(v128 a)
+{
+	return vgetq_lane_u64(a, 1);
+}
+
+static inline CLMUL_TARGET uint64_t v128_lo(v128 a)
+{
+	return vgetq_lane_u64(a, 0);
+}
+
+static inline CLMUL_TARGET v128 v128_xor(v128 a, v128 b)
+{
+	return veorq_u64(a, b);
+}
+
+/* hi(a) * khi ^ lo(a) * klo */
+static inline CLMUL_TARGET v128 v128_fold(v128 a, uint64_t khi, uint64_t klo)
+{
+	poly128_t h = vmull_p64(vgetq_lane_u64(a, 1), khi);
+	poly128_t l = vmull_p64(vgetq_lane_u64(a, 0), klo);
+
+	return veorq_u64(vreinterpretq_u64_p128(h), vreinterpretq_u64_p128(l));
+}
+
+static bool crc64_cpu_has_clmul(void)
+{
+	return getauxval(AT_HWCAP) & HWCAP_PMULL;
+}
+#endif
+
+#ifdef CRC64_HAVE_CLMUL
+static CLMUL_TARGET uint64_t crc64_be_clmul(uint64_t crc, const void *p,
+					    size_t len)
+{
+	const unsigned char *_p = p;
+	unsigned char rem[16];
+	v128 x0, x1, x2, x3;
+	uint64_t hi, lo;
+
+	if (len < 64)
+		return crc64_be(crc, p, len);
+
+	x0 = v128_xor(v128_load_be(_p), v128_make(crc, 0));
+	x1 = v128_load_be(_p + 16);
+	x2 = v128_load_be(_p + 32);
+	x3 = v128_load_be(_p + 48);
+	_p += 64;
+	len -= 64;
+
+	for (; len >= 64; len -= 64, _p += 64) {
+		x0 = v128_xor(v128_fold(x0, crc64_fold_512_hi,
+					crc64_fold_512_lo),
+			      v128_load_be(_p));
+		x1 = v128_xor(v128_fold(x1, crc64_fold_512_hi,
+					crc64_fold_512_lo),
+			      v128_load_be(_p + 16));
+		x2 = v128_xor(v128_fold(x2, crc64_fold_512_hi,
+					crc64_fold_512_lo),
+			      v128_load_be(_p + 32));
+		x3 = v128_xor(v128_fold(x3, crc64_fold_512_hi,
+					crc64_fold_512_lo),
+			      v128_load_be(_p + 48));
+	}
+
+	x0 = v128_xor(v128_fold(x0, crc64_fold_128_hi, crc64_fold_128_lo), x1);
+	x0 = v128_xor(v128_fold(x0, crc64_fold_128_hi, crc64_fold_128_lo), x2);
+	x0 = v128_xor(v128_fold(x0, crc64_fold_128_hi, crc64_fold_128_lo), x3);
+
+	for (; len >= 16; len -= 16, _p += 16)
+		x0 = v128_xor(v128_fold(x0, crc64_fold_128_hi,
+					crc64_fold_128_lo),
+			      v128_load_be(_p));
+
+	hi = v128_hi(x0);
+	lo = v128_lo(x0);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	hi = __builtin_bswap64(hi);
+	lo = __builtin_bswap64(lo);
+#endif
+	memcpy(rem, &hi, 8);
+	memcpy(rem + 8, &lo, 8);
+
+	crc = crc64_be(0, rem, sizeof(rem));
+	return crc64_be(crc, _p, len);
+}
+#endif
+
+static uint64_t (*crc64_be_impl)(uint64_t crc, const void *p, size_t len) =
+	crc64_be;
+
+#if defined(CRC64_HAVE_CLMUL) && defined(DEBUG)
+/* Cross-check the folding path against the table path */
+static bool crc64_clmul_selftest(void)
+{
+	unsigned char buf[1024 + 16];
+	size_t i, off, len;
 
-	crc = crc64_be(crc, data, len);
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i * 131 + (i >> 3);
+
+	for (off = 0; off < 16; off += 5)
+		for (len = 0; len + off <= sizeof(buf); len += 7)
+			if (crc64_be_clmul(~0ULL, buf + off, len) !=
+			    crc64_be(~0ULL, buf + off, len)) {
+				fprintf(stderr,
+					"crc64: carry-less multiply self-test failed (offset %zu, length %zu), using table lookups\n",
+					off, len);
+				return false;
+			}
+	return true;
+}
+#endif
+
+static void __attribute__((constructor)) crc64_init(void)
+{
+	crc64_init_slice_tables();
+
+	crc64_fold_512_hi = crc64_xpow_mod(512 + 64);
+	crc64_fold_512_lo = crc64_xpow_mod(512);
+	crc64_fold_128_hi = crc64_xpow_mod(128 + 64);
+	crc64_fold_128_lo = crc64_xpow_mod(128);
+
+#ifdef CRC64_HAVE_CLMUL
+	if (!crc64_cpu_has_clmul())
+		return;
+#ifdef DEBUG
+	if (!crc64_clmul_selftest())
+		return;
+#endif
+	crc64_be_impl = crc64_be_clmul;
+#endif
+}
+
+/* a * b mod P */
+static uint64_t crc64_mulmod(uint64_t a, uint64_t b)
+{
+	uint64_t r = 0;
+	int i;
+
+	for (i = 63; i >= 0; i--) {
+		r = (r << 1) ^ ((r >> 63) ? CRC64_POLY : 0);
+		if ((b >> i) & 1)
+			r ^= a;
+	}
+	return r;
+}
+
+/* x^(8 * len) mod P, by repeated squaring */
+static uint64_t crc64_shift_mod(size_t len)
+{
+	uint64_t r = 1, p = 1 << 8;
+
+	for (; len; len >>= 1) {
+		if (len & 1)
+			r = crc64_mulmod(r, p);
+		p = crc64_mulmod(p, p);
+	}
+	return r;
+}
+
+/**
+ * crc64_update - Extend a crc64 with more data
+ * @crc: crc64() of the data seen so far, 0 for no data
+ * @data: next chunk of the message
+ * @len: length of @data
+ *
+ * crc64_update(crc64(a, la), b, lb) == crc64(a || b, la + lb), so a stream
+ * can be checksummed chunk by chunk without buffering it whole.
+ */
+uint64_t crc64_update(uint64_t crc, const void *data, size_t len)
+{
+	crc = crc64_be_impl(crc ^ 0xFFFFFFFFFFFFFFFFULL, data, len);
 	return crc ^ 0xFFFFFFFFFFFFFFFFULL;
 }
+
+/**
+ * crc64_combine - Merge the crc64 of two adjacent pieces of data
+ * @crc_a: crc64() of the first piece
+ * @crc_b: crc64() of the second piece
+ * @len_b: length of the second piece
+ *
+ * Returns crc64() of the concatenation, so a large region can be split
+ * across threads and the partial results merged in order. The pre- and
+ * post-inversion of crc64() cancel out, leaving crc_a shifted past len_b
+ * bytes of zeroes, xor crc_b.
+ */
+uint64_t crc64_combine(uint64_t crc_a, uint64_t crc_b, size_t len_b)
+{
+	return crc64_mulmod(crc_a, crc64_shift_mod(len_b)) ^ crc_b;
+}
+
+uint64_t crc64(const void *data, size_t len)
+{
+	return crc64_update(0, data, len);
+}
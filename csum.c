@@ -0,0 +1,415 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Per-bucket checksum manifest of a cache device.
+ *
+ * Every bucket between sb.first_bucket and sb.nbuckets is read and
+ * checksummed with crc64, and the results are written to a small binary
+ * manifest. A later run compares the device against that manifest and
+ * reports the buckets whose contents changed, which catches silent media
+ * corruption and measures cache churn between two points in time.
+ */
+
+#define _FILE_OFFSET_BITS	64
+#define __USE_FILE_OFFSET64
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bcache.h"
+#include "lib.h"
+#include "bitwise.h"
+#include "csum.h"
+
+#define CSUM_MAP_VERSION	1
+#define CSUM_MAP_CHUNK		(4 << 20)	/* largest single read */
+#define CSUM_MAP_ALIGN		4096
+#define CSUM_MAP_MAX_JOBS	256
+
+static const char csum_map_magic[8] = "bcsummap";
+
+struct csum_map_header {
+	__u8		magic[8];
+	__le32		version;
+	__le32		bucket_size;	/* sectors */
+	__u8		uuid[16];
+	__u8		set_uuid[16];
+	__le64		first_bucket;
+	__le64		nbuckets;
+	__le64		csum;		/* crc64 of the checksum array */
+};
+
+struct csum_map_job {
+	int		fd;
+	char		*devname;
+	uint64_t	bucket_bytes;
+	uint64_t	first_bucket;
+	uint64_t	nbuckets;
+	uint64_t	next;		/* next bucket to hand out */
+	uint64_t	*csums;
+	int		err;
+};
+
+static int csum_map_usage(void)
+{
+	fprintf(stderr,
+		"Usage:	csum-map [option] cachedevice\n"
+		"	checksum every bucket of a cache device\n"
+		"	-o	--output {file}		write the bucket checksum manifest to file\n"
+		"	-c	--compare {file}	report buckets changed since manifest file was written\n"
+		"	-j	--jobs {n}		number of reader threads (default: online cpus, at most 256)\n"
+		"	-h	--help			show help information\n"
+		"Exit status is 2 if --compare found changed buckets.\n");
+	return EXIT_FAILURE;
+}
+
+static int read_full(int fd, void *buf, size_t len, off_t offset)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pread(fd, buf, len, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf += ret;
+		len -= ret;
+		offset += ret;
+	}
+	return 0;
+}
+
+static void *csum_map_worker(void *arg)
+{
+	struct csum_map_job *job = arg;
+	size_t chunk = job->bucket_bytes < CSUM_MAP_CHUNK ?
+		       job->bucket_bytes : CSUM_MAP_CHUNK;
+	uint64_t b, done, crc;
+	void *buf;
+
+	if (posix_memalign(&buf, CSUM_MAP_ALIGN, chunk)) {
+		fprintf(stderr, "Error: fail to allocate read buffer\n");
+		job->err = 1;
+		return NULL;
+	}
+
+	while (!job->err) {
+		b = __sync_fetch_and_add(&job->next, 1);
+		if (b >= job->nbuckets)
+			break;
+
+		crc = 0;
+		for (done = 0; done < job->bucket_bytes; done += chunk) {
+			size_t len = job->bucket_bytes - done < chunk ?
+				     job->bucket_bytes - done : chunk;
+
+			if (read_full(job->fd, buf, len,
+				      b * job->bucket_bytes + done)) {
+				fprintf(stderr,
+					"Failed to read bucket %" PRIu64 " of %s: %m\n",
+					b, job->devname);
+				job->err = 1;
+				break;
+			}
+			crc = crc64_update(crc, buf, len);
+		}
+		job->csums[b - job->first_bucket] = crc;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static int csum_map_scan(struct csum_map_job *job, unsigned int jobs)
+{
+	pthread_t *threads;
+	unsigned int i, started;
+
+	threads = calloc(jobs, sizeof(*threads));
+	if (threads == NULL) {
+		fprintf(stderr, "Error: fail to allocate memory buffer\n");
+		return 1;
+	}
+
+	job->next = job->first_bucket;
+	for (started = 0; started < jobs; started++)
+		if (pthread_create(&threads[started], NULL,
+				   csum_map_worker, job))
+			break;
+
+	if (!started) {
+		fprintf(stderr, "Failed to start reader threads\n");
+		free(threads);
+		return 1;
+	}
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+	return job->err;
+}
+
+static int csum_map_write(char *path, struct cache_sb *sb, uint64_t *csums,
+			  uint64_t count)
+{
+	struct csum_map_header hdr;
+	uint64_t i;
+	FILE *f;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, csum_map_magic, sizeof(hdr.magic));
+	hdr.version = cpu_to_le32(CSUM_MAP_VERSION);
+	hdr.bucket_size = cpu_to_le32(sb->bucket_size);
+	memcpy(hdr.uuid, sb->uuid, 16);
+	memcpy(hdr.set_uuid, sb->set_uuid, 16);
+	hdr.first_bucket = cpu_to_le64(sb->first_bucket);
+	hdr.nbuckets = cpu_to_le64(sb->nbuckets);
+
+	for (i = 0; i < count; i++)
+		csums[i] = cpu_to_le64(csums[i]);
+	hdr.csum = cpu_to_le64(crc64(csums, count * sizeof(*csums)));
+
+	f = fopen(path, "w");
+	if (f == NULL) {
+		fprintf(stderr, "Can't open %s: %m\n", path);
+		return 1;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    fwrite(csums, sizeof(*csums), count, f) != count) {
+		fprintf(stderr, "Failed to write %s: %m\n", path);
+		fclose(f);
+		return 1;
+	}
+	if (fclose(f)) {
+		fprintf(stderr, "Failed to write %s: %m\n", path);
+		return 1;
+	}
+
+	for (i = 0; i < count; i++)
+		csums[i] = le64_to_cpu(csums[i]);
+	return 0;
+}
+
+static uint64_t *csum_map_read(char *path, struct cache_sb *sb,
+			       uint64_t *count)
+{
+	struct csum_map_header hdr;
+	uint64_t *csums = NULL;
+	uint64_t i, n;
+	struct stat st;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "Can't open %s: %m\n", path);
+		return NULL;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    memcmp(hdr.magic, csum_map_magic, sizeof(hdr.magic)) ||
+	    le32_to_cpu(hdr.version) != CSUM_MAP_VERSION) {
+		fprintf(stderr, "%s is not a bucket checksum manifest\n", path);
+		goto err;
+	}
+	if (memcmp(hdr.uuid, sb->uuid, 16) ||
+	    le32_to_cpu(hdr.bucket_size) != sb->bucket_size ||
+	    le64_to_cpu(hdr.first_bucket) != sb->first_bucket) {
+		fprintf(stderr,
+			"Manifest %s was taken from a different cache device or layout\n",
+			path);
+		goto err;
+	}
+
+	/*
+	 * Devices only grow (see resize), so a manifest can't have more
+	 * buckets than the device, and the file holds exactly its array.
+	 */
+	if (le64_to_cpu(hdr.nbuckets) <= sb->first_bucket ||
+	    le64_to_cpu(hdr.nbuckets) > sb->nbuckets) {
+		fprintf(stderr, "Manifest %s is corrupt\n", path);
+		goto err;
+	}
+	n = le64_to_cpu(hdr.nbuckets) - sb->first_bucket;
+	if (fstat(fileno(f), &st) ||
+	    (uint64_t) st.st_size != sizeof(hdr) + n * sizeof(*csums)) {
+		fprintf(stderr, "Manifest %s is truncated or corrupt\n", path);
+		goto err;
+	}
+	csums = malloc(n * sizeof(*csums));
+	if (csums == NULL) {
+		fprintf(stderr, "Error: fail to allocate memory buffer\n");
+		goto err;
+	}
+	if (fread(csums, sizeof(*csums), n, f) != n ||
+	    crc64(csums, n * sizeof(*csums)) != le64_to_cpu(hdr.csum)) {
+		fprintf(stderr, "Manifest %s is truncated or corrupt\n", path);
+		goto err;
+	}
+	fclose(f);
+
+	for (i = 0; i < n; i++)
+		csums[i] = le64_to_cpu(csums[i]);
+	*count = n;
+	return csums;
+err:
+	free(csums);
+	fclose(f);
+	return NULL;
+}
+
+static int csum_map_compare(struct cache_sb *sb, uint64_t *old,
+			    uint64_t nold, uint64_t *new, uint64_t nnew)
+{
+	uint64_t i, changed = 0;
+
+	for (i = 0; i < nold && i < nnew; i++) {
+		if (old[i] == new[i])
+			continue;
+		printf("bucket %" PRIu64 "\tsector %" PRIu64 "\tchanged\n",
+		       i + sb->first_bucket,
+		       (i + sb->first_bucket) * sb->bucket_size);
+		changed++;
+	}
+	if (nold != nnew)
+		printf("bucket count changed from %" PRIu64 " to %" PRIu64 "\n",
+		       nold, nnew);
+
+	printf("%" PRIu64 " of %" PRIu64 " buckets changed\n", changed,
+	       nold < nnew ? nold : nnew);
+	return (changed || nold != nnew) ? 2 : 0;
+}
+
+int csum_map(int argc, char **argv)
+{
+	char *output = NULL, *compare = NULL, *devname;
+	struct cache_sb_disk sb_disk;
+	struct csum_map_job job;
+	struct cache_sb sb;
+	uint64_t *old = NULL, nold = 0, count;
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	int o, ret = 1;
+
+	static struct option long_options[] = {
+		{"output", required_argument, 0, 'o'},
+		{"compare", required_argument, 0, 'c'},
+		{"jobs", required_argument, 0, 'j'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	while ((o = getopt_long(argc, argv, "o:c:j:h", long_options,
+				NULL)) != EOF) {
+		switch (o) {
+		case 'o':
+			output = optarg;
+			break;
+		case 'c':
+			compare = optarg;
+			break;
+		case 'j':
+			jobs = atol(optarg);
+			if (jobs < 1) {
+				fprintf(stderr, "Bad number of jobs\n");
+				return 1;
+			}
+			break;
+		case 'h':
+		default:
+			return csum_map_usage();
+		}
+	}
+	if (argc - optind != 1 || (!output && !compare))
+		return csum_map_usage();
+	if (jobs < 1)
+		jobs = 1;
+	if (jobs > CSUM_MAP_MAX_JOBS)
+		jobs = CSUM_MAP_MAX_JOBS;
+	devname = argv[optind];
+
+	memset(&job, 0, sizeof(job));
+	job.devname = devname;
+	job.fd = open(devname, O_RDONLY);
+	if (job.fd < 0) {
+		fprintf(stderr, "Can't open dev %s: %m\n", devname);
+		return 1;
+	}
+
+	if (pread(job.fd, &sb_disk, sizeof(sb_disk), SB_START) !=
+	    sizeof(sb_disk)) {
+		fprintf(stderr, "Couldn't read superblock of %s\n", devname);
+		goto out;
+	}
+
+	to_cache_sb_head(&sb, &sb_disk);
+	if (memcmp(sb.magic, bcache_magic, 16) ||
+	    le64_to_cpu(sb_disk.csum) != csum_set(&sb_disk)) {
+		fprintf(stderr, "%s has no valid bcache superblock\n", devname);
+		goto out;
+	}
+	if (sb.version != BCACHE_SB_VERSION_CDEV &&
+	    sb.version != BCACHE_SB_VERSION_CDEV_WITH_UUID &&
+	    sb.version != BCACHE_SB_VERSION_CDEV_WITH_FEATURES) {
+		fprintf(stderr, "%s is not a cache device\n", devname);
+		goto out;
+	}
+	if (sb.nbuckets <= sb.first_bucket) {
+		fprintf(stderr, "%s has no buckets\n", devname);
+		goto out;
+	}
+
+	if (compare) {
+		old = csum_map_read(compare, &sb, &nold);
+		if (old == NULL)
+			goto out;
+	}
+
+	job.bucket_bytes = (uint64_t) sb.bucket_size << 9;
+	job.first_bucket = sb.first_bucket;
+	job.nbuckets = sb.nbuckets;
+	count = sb.nbuckets - sb.first_bucket;
+	job.csums = calloc(count, sizeof(*job.csums));
+	if (job.csums == NULL) {
+		fprintf(stderr, "Error: fail to allocate memory buffer\n");
+		goto out;
+	}
+
+	/*
+	 * Bypass the page cache for the bulk reads when the buckets are
+	 * aligned well enough for it, so a full pass neither evicts
+	 * everything else nor reports what the page cache holds.
+	 */
+	if (!(job.bucket_bytes % CSUM_MAP_ALIGN)) {
+		int fd = open(devname, O_RDONLY | O_DIRECT);
+
+		if (fd >= 0) {
+			close(job.fd);
+			job.fd = fd;
+		}
+	}
+
+	if (csum_map_scan(&job, jobs))
+		goto out;
+
+	ret = 0;
+	if (output && csum_map_write(output, &sb, job.csums, count))
+		ret = 1;
+	if (!ret && compare)
+		ret = csum_map_compare(&sb, old, nold, job.csums, count);
+out:
+	free(old);
+	free(job.csums);
+	if (job.fd >= 0)
+		close(job.fd);
+	return ret;
+}
@@ -0,0 +1,8 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#ifndef _BCACHE_CSUM_H
+#define _BCACHE_CSUM_H
+
+int csum_map(int argc, char **argv);
+
+#endif
@@ -0,0 +1,260 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Discard a whole device before formatting it as a cache.
+ *
+ * A single BLKDISCARD over a multi-terabyte SSD can take many minutes
+ * without any sign of life, and some devices time it out. The device is
+ * cut into aligned chunks instead, which a few threads issue in turn,
+ * optionally paced to a rate limit, while the percentage done is shown.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "discard.h"
+
+/* Large enough to keep the ioctl overhead down, small enough to report */
+#define DISCARD_CHUNK		(1ULL << 30)
+#define DISCARD_CHUNK_MIN	(1ULL << 20)
+
+const char * const discard_modes[] = {
+	"auto",
+	"discard",
+	"zeroout",
+	"secure",
+	"punch",
+	NULL
+};
+
+static const char * const discard_names[] = {
+	[DISCARD_DISCARD]	= "blkdiscard",
+	[DISCARD_ZEROOUT]	= "zeroout",
+	[DISCARD_SECURE]	= "secure discard",
+	[DISCARD_PUNCH]		= "hole punching",
+};
+
+struct discard_job {
+	char		*path;
+	int		fd;
+	unsigned int	mode;
+	uint64_t	end;
+	uint64_t	chunk;
+	uint64_t	rate;
+
+	pthread_mutex_t	lock;
+	uint64_t	next;		/* start of the next chunk to issue */
+	uint64_t	done;
+	struct timespec	pace;		/* earliest start of the next chunk */
+	int		shown;		/* percentage last printed */
+	bool		tty;
+	int		err;
+};
+
+static int discard_range(struct discard_job *job, uint64_t start,
+			 uint64_t len)
+{
+	uint64_t range[2] = { start, len };
+
+	switch (job->mode) {
+	case DISCARD_ZEROOUT:
+		return ioctl(job->fd, BLKZEROOUT, &range);
+	case DISCARD_SECURE:
+		return ioctl(job->fd, BLKSECDISCARD, &range);
+	case DISCARD_PUNCH:
+		return fallocate(job->fd,
+				 FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				 start, len);
+	default:
+		return ioctl(job->fd, BLKDISCARD, &range);
+	}
+}
+
+/* Called with job->lock held: when may a chunk of @len bytes start */
+static void discard_pace(struct discard_job *job, uint64_t len,
+			 struct timespec *at)
+{
+	struct timespec now;
+	uint64_t nsec;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (job->pace.tv_sec < now.tv_sec ||
+	    (job->pace.tv_sec == now.tv_sec &&
+	     job->pace.tv_nsec < now.tv_nsec))
+		job->pace = now;
+	*at = job->pace;
+
+	nsec = job->pace.tv_nsec + len * 1000000000ULL / job->rate;
+	job->pace.tv_sec += nsec / 1000000000ULL;
+	job->pace.tv_nsec = nsec % 1000000000ULL;
+}
+
+/* Called with job->lock held */
+static void discard_progress(struct discard_job *job)
+{
+	int percent = job->done * 100 / job->end;
+
+	if (!job->tty || percent == job->shown)
+		return;
+	job->shown = percent;
+	printf("\r%s %s: %3d%%", job->path, discard_names[job->mode],
+	       percent);
+	fflush(stdout);
+}
+
+static void *discard_worker(void *arg)
+{
+	struct discard_job *job = arg;
+	struct timespec at;
+	uint64_t start, len;
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		if (job->err || job->next >= job->end) {
+			pthread_mutex_unlock(&job->lock);
+			break;
+		}
+		start = job->next;
+		len = job->end - start;
+		if (len > job->chunk)
+			len = job->chunk;
+		job->next += len;
+		if (job->rate)
+			discard_pace(job, len, &at);
+		pthread_mutex_unlock(&job->lock);
+
+		if (job->rate)
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					       &at, NULL) == EINTR)
+				;
+
+		if (discard_range(job, start, len)) {
+			pthread_mutex_lock(&job->lock);
+			if (!job->err)
+				job->err = errno;
+			pthread_mutex_unlock(&job->lock);
+			break;
+		}
+
+		pthread_mutex_lock(&job->lock);
+		job->done += len;
+		discard_progress(job);
+		pthread_mutex_unlock(&job->lock);
+	}
+	return NULL;
+}
+
+/*
+ * Returns 0 when the whole device was discarded. Devices that don't
+ * support discards are common, so that is only mentioned on stdout;
+ * other failures are reported on stderr as well. Either way the device can still
+ * be formatted.
+ */
+int discard_dev(char *path, int fd, struct discard_opts *opts)
+{
+	struct discard_job job;
+	unsigned int i, nr_threads, started = 0;
+	pthread_t *threads;
+	unsigned int secsize = 512;
+	uint64_t size;
+	struct stat sb;
+
+	memset(&job, 0, sizeof(job));
+	job.path = path;
+	job.fd = fd;
+	job.mode = opts->mode;
+	job.rate = opts->rate;
+	job.shown = -1;
+	job.tty = isatty(STDOUT_FILENO);
+
+	if (fstat(fd, &sb) == -1) {
+		fprintf(stderr, "Can't stat %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (S_ISBLK(sb.st_mode)) {
+		if (ioctl(fd, BLKGETSIZE64, &size) ||
+		    ioctl(fd, BLKSSZGET, &secsize)) {
+			fprintf(stderr, "Can't get the size of %s: %s\n",
+				path, strerror(errno));
+			return -1;
+		}
+		if (job.mode == DISCARD_AUTO)
+			job.mode = DISCARD_DISCARD;
+	} else if (S_ISREG(sb.st_mode)) {
+		size = sb.st_size;
+		if (job.mode == DISCARD_AUTO)
+			job.mode = DISCARD_PUNCH;
+		if (job.mode != DISCARD_PUNCH) {
+			fprintf(stderr,
+				"%s is a file, only hole punching applies\n",
+				path);
+			return -1;
+		}
+	} else {
+		fprintf(stderr, "Can't discard %s: not a block device or file\n",
+			path);
+		return -1;
+	}
+
+	/* align the range to the sector size */
+	job.end = size & ~((uint64_t) secsize - 1);
+	if (job.end == 0)
+		return 0;
+
+	/* With a rate limit, chunks of about a second keep the pace even */
+	job.chunk = DISCARD_CHUNK;
+	if (job.rate && job.rate < job.chunk)
+		job.chunk = job.rate > DISCARD_CHUNK_MIN ?
+			    job.rate : DISCARD_CHUNK_MIN;
+	job.chunk &= ~((uint64_t) secsize - 1);
+
+	nr_threads = opts->threads ? opts->threads : 1;
+	if (nr_threads > (job.end + job.chunk - 1) / job.chunk)
+		nr_threads = (job.end + job.chunk - 1) / job.chunk;
+
+	pthread_mutex_init(&job.lock, NULL);
+	if (job.tty) {
+		discard_progress(&job);
+	} else {
+		printf("%s %s beginning...", path, discard_names[job.mode]);
+		fflush(stdout);
+	}
+
+	/* The calling thread works too, so fewer threads is merely slower */
+	threads = calloc(nr_threads, sizeof(*threads));
+	for (i = 1; threads && i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, discard_worker, &job))
+			break;
+		started++;
+	}
+	discard_worker(&job);
+	for (i = 1; i <= started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&job.lock);
+
+	if (job.err == EOPNOTSUPP && job.mode == DISCARD_DISCARD) {
+		printf(" not supported\n");
+		return -1;
+	}
+	if (job.err) {
+		printf(" failed\n");
+		fprintf(stderr, "%s %s failed: %s\n", path,
+			discard_names[job.mode], strerror(job.err));
+		return -1;
+	}
+	printf(job.tty ? "\n" : "done\n");
+	return 0;
+}
@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __DISCARD_H
+#define __DISCARD_H
+
+#include <stdint.h>
+
+/* How a cache device is emptied before its superblock is written */
+enum discard_mode {
+	DISCARD_AUTO,		/* BLKDISCARD, or punching holes in files */
+	DISCARD_DISCARD,	/* BLKDISCARD */
+	DISCARD_ZEROOUT,	/* BLKZEROOUT */
+	DISCARD_SECURE,		/* BLKSECDISCARD */
+	DISCARD_PUNCH,		/* fallocate(FALLOC_FL_PUNCH_HOLE) */
+};
+
+/* Names of enum discard_mode, for read_string_list() */
+extern const char * const discard_modes[];
+
+struct discard_opts {
+	unsigned int	mode;
+	unsigned int	threads;
+	uint64_t	rate;		/* bytes per second, 0 is unlimited */
+};
+
+#define DISCARD_THREADS_DEFAULT	4
+
+int discard_dev(char *path, int fd, struct discard_opts *opts);
+
+#endif
@@ -0,0 +1,364 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Block and bucket sizes that fit the devices being formatted.
+ *
+ * make-bcache uses the logical block size and 512k buckets unless told
+ * otherwise. Buckets that don't line up with the erase blocks or optimal
+ * I/O size of a cache SSD cost write amplification and garbage collection
+ * overhead, so --auto-geometry picks the sizes from the I/O limits the
+ * kernel reports, and says why.
+ *
+ * Backing devices on a RAID stripe likewise get their data offset
+ * aligned to a full stripe.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "bcache.h"
+#include "geometry.h"
+
+#define BUCKET_SIZE_DEFAULT	1024	/* sectors, as without -b */
+
+/*
+ * Queue and md attributes live on the whole disk, partitions find them in
+ * their parent's directory.
+ */
+static int read_dev_attr(dev_t devt, const char *attr, char *buf, int size)
+{
+	char path[128];
+	FILE *f;
+	int ret = 1;
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s",
+		 major(devt), minor(devt), attr);
+	f = fopen(path, "r");
+	if (f == NULL) {
+		snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../%s",
+			 major(devt), minor(devt), attr);
+		f = fopen(path, "r");
+	}
+	if (f == NULL)
+		return 1;
+	if (fgets(buf, size, f)) {
+		buf[strcspn(buf, "\n")] = '\0';
+		ret = 0;
+	}
+	fclose(f);
+	return ret;
+}
+
+static uint64_t read_dev_attr_u64(dev_t devt, const char *attr)
+{
+	char buf[32];
+
+	if (read_dev_attr(devt, attr, buf, sizeof(buf)))
+		return 0;
+	return strtoull(buf, NULL, 10);
+}
+
+/* Files get their file system block size and nothing else */
+int read_geometry(const char *path, struct dev_geometry *geo)
+{
+	struct stat st;
+	int fd;
+
+	memset(geo, 0, sizeof(*geo));
+	if (stat(path, &st)) {
+		fprintf(stderr, "Error statting %s: %s\n",
+			path, strerror(errno));
+		return 1;
+	}
+	geo->devt = st.st_rdev;
+	if (!S_ISBLK(st.st_mode)) {
+		geo->logical_block_size = st.st_blksize;
+		geo->physical_block_size = st.st_blksize;
+		return 0;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "open(%s) failed: %m\n", path);
+		return 1;
+	}
+	geo->blockdev = true;
+	if (ioctl(fd, BLKSSZGET, &geo->logical_block_size) ||
+	    ioctl(fd, BLKPBSZGET, &geo->physical_block_size) ||
+	    ioctl(fd, BLKIOMIN, &geo->minimum_io_size) ||
+	    ioctl(fd, BLKIOOPT, &geo->optimal_io_size) ||
+	    ioctl(fd, BLKALIGNOFF, &geo->alignment_offset)) {
+		fprintf(stderr, "Can't get the I/O limits of %s: %m\n", path);
+		close(fd);
+		return 1;
+	}
+	close(fd);
+
+	geo->rotational = read_dev_attr_u64(st.st_rdev, "queue/rotational");
+	geo->discard_granularity =
+		read_dev_attr_u64(st.st_rdev, "queue/discard_granularity");
+	return 0;
+}
+
+static bool is_power_of_2(uint64_t v)
+{
+	return v && !(v & (v - 1));
+}
+
+static const char *human_size(uint64_t bytes, char *buf, size_t size)
+{
+	const char *units = "kMGT";
+	int i = -1;
+
+	while (bytes >= 1024 && !(bytes % 1024) && units[i + 1]) {
+		bytes /= 1024;
+		i++;
+	}
+	if (i < 0)
+		snprintf(buf, size, "%llu", (unsigned long long) bytes);
+	else
+		snprintf(buf, size, "%llu%c", (unsigned long long) bytes,
+			 units[i]);
+	return buf;
+}
+
+static void print_geometry(const char *path, struct dev_geometry *geo)
+{
+	char a[24], b[24], c[24], d[24], e[24];
+
+	if (!geo->blockdev) {
+		printf("%s: not a block device, block size %s\n", path,
+		       human_size(geo->logical_block_size, a, sizeof(a)));
+		return;
+	}
+	printf("%s: logical block %s, physical block %s, minimum I/O %s, "
+	       "optimal I/O %s, alignment offset %d, %s, "
+	       "discard granularity %s\n", path,
+	       human_size(geo->logical_block_size, a, sizeof(a)),
+	       human_size(geo->physical_block_size, b, sizeof(b)),
+	       human_size(geo->minimum_io_size, c, sizeof(c)),
+	       human_size(geo->optimal_io_size, d, sizeof(d)),
+	       geo->alignment_offset,
+	       geo->rotational ? "rotational" : "non-rotational",
+	       human_size(geo->discard_granularity, e, sizeof(e)));
+}
+
+/*
+ * The unit a cache device's buckets should be a multiple of: the largest
+ * of its discard granularity (often the erase block), optimal and minimum
+ * I/O size and physical block size that is a power of two, as buckets
+ * are.
+ */
+static uint64_t bucket_unit(const char *path, struct dev_geometry *geo,
+			    const char **why)
+{
+	struct {
+		uint64_t	bytes;
+		const char	*name;
+	} limits[] = {
+		{ geo->discard_granularity,	"discard granularity" },
+		{ geo->optimal_io_size,		"optimal I/O size" },
+		{ geo->minimum_io_size,		"minimum I/O size" },
+		{ geo->physical_block_size,	"physical block size" },
+	};
+	uint64_t unit = 0;
+	unsigned int i;
+	char buf[24];
+
+	for (i = 0; i < sizeof(limits) / sizeof(limits[0]); i++) {
+		if (!limits[i].bytes)
+			continue;
+		if (!is_power_of_2(limits[i].bytes)) {
+			printf("%s: ignoring %s %s, not a power of two\n",
+			       path, limits[i].name,
+			       human_size(limits[i].bytes, buf, sizeof(buf)));
+			continue;
+		}
+		if (limits[i].bytes > unit) {
+			unit = limits[i].bytes;
+			*why = limits[i].name;
+		}
+	}
+	return unit;
+}
+
+/*
+ * Sizes are in sectors; a non-zero *block_size or *bucket_size was given
+ * on the command line and is kept. The block size must fit every device,
+ * the bucket size only matters for the cache device.
+ */
+void choose_geometry(char **cache_devices, unsigned int ncache_devices,
+		     char **backing_devices, unsigned int nbacking_devices,
+		     unsigned int *block_size, unsigned int *bucket_size)
+{
+	unsigned int i, nr = ncache_devices + nbacking_devices;
+	unsigned int page_sectors = sysconf(_SC_PAGESIZE) / 512;
+	unsigned int block = 0, bucket = BUCKET_SIZE_DEFAULT;
+	const char *block_dev = NULL, *bucket_dev = NULL;
+	const char *why = NULL, *dev_why = NULL;
+	struct dev_geometry geo;
+	uint64_t unit;
+	char buf[24];
+
+	printf("Device geometry:\n");
+	for (i = 0; i < nr; i++) {
+		char *path = i < ncache_devices ? cache_devices[i] :
+			     backing_devices[i - ncache_devices];
+		bool cache = i < ncache_devices;
+		unsigned int sectors;
+
+		if (read_geometry(path, &geo))
+			exit(EXIT_FAILURE);
+		print_geometry(path, &geo);
+
+		/* Writes smaller than a physical block are read-modify-write */
+		sectors = geo.physical_block_size / 512;
+		if (sectors < geo.logical_block_size / 512)
+			sectors = geo.logical_block_size / 512;
+		if (sectors > block) {
+			block = sectors;
+			block_dev = path;
+		}
+
+		if (geo.alignment_offset)
+			printf("%s: WARNING: starts %d bytes into a physical "
+			       "block, consider realigning the partition\n",
+			       path, geo.alignment_offset);
+		if (!cache)
+			continue;
+		if (geo.rotational)
+			printf("%s: WARNING: rotational cache device\n", path);
+		unit = bucket_unit(path, &geo, &dev_why);
+		if (unit / 512 > bucket) {
+			bucket = unit / 512;
+			bucket_dev = path;
+			why = dev_why;
+		}
+	}
+	putchar('\n');
+
+	if (*block_size) {
+		printf("Block size:	%u sectors, from --block\n", *block_size);
+	} else {
+		if (block > page_sectors) {
+			printf("Block size:	%u sectors, the page size; "
+			       "%s would need %u\n", page_sectors, block_dev,
+			       block);
+			block = page_sectors;
+		} else {
+			printf("Block size:	%u sectors, the largest "
+			       "physical block size (%s)\n", block, block_dev);
+		}
+		*block_size = block;
+	}
+
+	if (*bucket_size) {
+		if (ncache_devices)
+			printf("Bucket size:	%u sectors, from --bucket\n",
+			       *bucket_size);
+	} else {
+		if (bucket_dev)
+			printf("Bucket size:	%u sectors, the %s of %s (%s)\n",
+			       bucket, why, bucket_dev,
+			       human_size((uint64_t) bucket * 512, buf,
+					  sizeof(buf)));
+		else if (ncache_devices)
+			printf("Bucket size:	%u sectors, the default, a "
+			       "multiple of the cache device's I/O limits\n",
+			       bucket);
+		*bucket_size = bucket;
+	}
+	putchar('\n');
+}
+
+/*
+ * Width of a full stripe in sectors, or 0 if the device isn't striped.
+ * md arrays are described by their level and chunk size; for anything
+ * else (hardware RAID, dm stripes) an optimal I/O size that is a multiple
+ * of the minimum I/O size, i.e. the chunk, is taken as the stripe.
+ */
+static uint64_t stripe_width(struct dev_geometry *geo, char *desc, int size)
+{
+	char level[16], buf[24];
+	uint64_t chunk, disks, data_disks = 0, layout;
+
+	if (!read_dev_attr(geo->devt, "md/level", level, sizeof(level))) {
+		chunk = read_dev_attr_u64(geo->devt, "md/chunk_size");
+		disks = read_dev_attr_u64(geo->devt, "md/raid_disks");
+		if (!strcmp(level, "raid0")) {
+			data_disks = disks;
+		} else if (!strcmp(level, "raid4") || !strcmp(level, "raid5")) {
+			data_disks = disks > 1 ? disks - 1 : 0;
+		} else if (!strcmp(level, "raid6")) {
+			data_disks = disks > 2 ? disks - 2 : 0;
+		} else if (!strcmp(level, "raid10")) {
+			/* near copies in the low byte, far copies above */
+			layout = read_dev_attr_u64(geo->devt, "md/layout");
+			layout = (layout & 0xff) * ((layout >> 8) & 0xff);
+			data_disks = layout ? disks / layout : 0;
+		}
+		if (chunk && data_disks) {
+			snprintf(desc, size, "%s, %llu data disks, %s chunks",
+				 level, (unsigned long long) data_disks,
+				 human_size(chunk, buf, sizeof(buf)));
+			return chunk / 512 * data_disks;
+		}
+	}
+
+	if (geo->minimum_io_size &&
+	    geo->optimal_io_size > geo->minimum_io_size &&
+	    !(geo->optimal_io_size % geo->minimum_io_size)) {
+		snprintf(desc, size, "optimal I/O size %s",
+			 human_size(geo->optimal_io_size, buf, sizeof(buf)));
+		return geo->optimal_io_size / 512;
+	}
+	return 0;
+}
+
+/*
+ * Like check_data_offset_for_zoned_device(): a backing device on a RAID
+ * stripe gets its data started on a full stripe boundary, so that full
+ * stripe writes from writeback don't turn into read-modify-write. The
+ * partition start counts, as the stripes are those of the whole disk.
+ * A data_offset the user chose is kept, with a warning if misaligned.
+ */
+void check_data_offset_for_stripe(char *devname, uint64_t *data_offset)
+{
+	struct dev_geometry geo;
+	uint64_t width, start, misalign, offset = *data_offset;
+	char desc[64];
+
+	if (read_geometry(devname, &geo) || !geo.blockdev)
+		return;
+	width = stripe_width(&geo, desc, sizeof(desc));
+	if (!width)
+		return;
+
+	start = read_dev_attr_u64(geo.devt, "start");
+	misalign = (start + offset) % width;
+	if (!misalign)
+		return;
+
+	if (offset != BDEV_DATA_START_DEFAULT) {
+		fprintf(stderr,
+			"WARNING: data_offset %llu of %s is not aligned to its full stripe of %llu sectors (%s)\n",
+			(unsigned long long) offset, devname,
+			(unsigned long long) width, desc);
+		return;
+	}
+
+	offset += width - misalign;
+	printf("Data offset of %s aligned to its full stripe of %llu sectors (%s): %llu sectors\n\n",
+	       devname, (unsigned long long) width, desc,
+	       (unsigned long long) offset);
+	*data_offset = offset;
+}
@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __GEOMETRY_H
+#define __GEOMETRY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* I/O limits of a device, in bytes */
+struct dev_geometry {
+	dev_t		devt;
+	bool		blockdev;
+	unsigned int	logical_block_size;
+	unsigned int	physical_block_size;
+	unsigned int	minimum_io_size;
+	unsigned int	optimal_io_size;
+	int		alignment_offset;
+	bool		rotational;
+	uint64_t	discard_granularity;
+};
+
+int read_geometry(const char *path, struct dev_geometry *geo);
+void choose_geometry(char **cache_devices, unsigned int ncache_devices,
+		     char **backing_devices, unsigned int nbacking_devices,
+		     unsigned int *block_size, unsigned int *bucket_size);
+void check_data_offset_for_stripe(char *devname, uint64_t *data_offset);
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <blkid.h>
+#include <errno.h>
 #include <dirent.h>
 #include <limits.h>
 #include <sys/types.h>
@@ -12,11 +13,15 @@
 #include <uuid.h>
 #include <string.h>
 #include <malloc.h>
-#include <regex.h>
+#include <pthread.h>
 
 #include "bcache.h"
 #include "lib.h"
 #include "bitwise.h"
+#include "uring.h"
+#include "topology.h"
+#include "sbcache.h"
+#include "scanfilter.h"
 /*
  * utils function
  */
@@ -117,24 +122,6 @@ void print_encode(char *in)
 			printf("%%%x", *pos);
 }
 
-bool part_of_disk(char *devname, char *partname)
-{
-	char pattern[40];
-	int status;
-	regmatch_t regmatche;
-	regex_t reg;
-
-	sprintf(pattern, "^%s.*[0-9]$", devname);
-	if (regcomp(&reg, pattern, REG_EXTENDED) != 0)
-		fprintf(stderr, "Error happen when compile reg\n");
-	status = regexec(&reg, partname, 1, &regmatche, 0);
-	regfree(&reg);
-	if (status == REG_NOMATCH)
-		return false;
-	else
-		return true;
-}
-
 int find_location(char *location, char *devname)
 {
 	char path[300];
@@ -335,23 +322,35 @@ int cset_to_devname(struct list_head *head, char *cset, char *devname)
 }
 
 
-int detail_base(char *devname, struct cache_sb sb, struct dev *base)
+static void detail_base_sb(char *devname, struct cache_sb *sb,
+			   struct dev *base)
 {
-	int ret;
-
-	base->sb = sb;
 	strcpy(base->name, devname);
 	base->magic = "ok";
 	base->first_sector = SB_SECTOR;
-	base->version = sb.version;
+	base->version = sb->version;
 
-	strncpy(base->label, (char *) sb.label, SB_LABEL_SIZE);
+	strncpy(base->label, (char *) sb->label, SB_LABEL_SIZE);
 	base->label[SB_LABEL_SIZE] = '\0';
 
-	uuid_unparse(sb.uuid, base->uuid);
-	uuid_unparse(sb.set_uuid, base->cset);
-	base->sectors_per_block = sb.block_size;
-	base->sectors_per_bucket = sb.bucket_size;
+	uuid_unparse(sb->uuid, base->uuid);
+	uuid_unparse(sb->set_uuid, base->cset);
+	base->sectors_per_block = sb->block_size;
+	base->sectors_per_bucket = sb->bucket_size;
+	base->feature_compat = sb->feature_compat;
+	base->feature_ro_compat = sb->feature_ro_compat;
+	base->feature_incompat = sb->feature_incompat;
+	/* shares its space with data_offset on backing devices */
+	base->nr_in_set = SB_IS_BDEV(sb) ? 0 : sb->nr_in_set;
+	base->nr_this_dev = SB_IS_BDEV(sb) ? 0 : sb->nr_this_dev;
+	base->paths[0] = '\0';
+}
+
+int detail_base(char *devname, struct cache_sb *sb, struct dev *base)
+{
+	int ret;
+
+	detail_base_sb(devname, sb, base);
 	ret = get_state(base, base->state);
 	if (ret != 0) {
 		fprintf(stderr, "Failed to get state for %s\n", devname);
@@ -371,92 +370,459 @@ int detail_base(char *devname, struct cache_sb sb, struct dev *base)
 	return 0;
 }
 
+/*
+ * Same as detail_base(), but answers the sysfs lookups from a topology
+ * snapshot. The per version rules follow get_state(), get_bname() and
+ * get_point().
+ */
+static int detail_base_topo(char *devname, struct cache_sb *sb,
+			    struct dev *base, struct topology *topo,
+			    struct topo_node *node)
+{
+	detail_base_sb(devname, sb, base);
+
+	if (base->version == BCACHE_SB_VERSION_CDEV ||
+	    base->version == BCACHE_SB_VERSION_CDEV_WITH_UUID ||
+	    base->version == BCACHE_SB_VERSION_CDEV_WITH_FEATURES) {
+		strcpy(base->state, topo_cset_active(topo, base->cset) ?
+		       BCACHE_BASIC_STATE_ACTIVE : BCACHE_BASIC_STATE_INACTIVE);
+	} else if (base->version == BCACHE_SB_VERSION_BDEV ||
+		   base->version == BCACHE_SB_VERSION_BDEV_WITH_OFFSET ||
+		   base->version == BCACHE_SB_VERSION_BDEV_WITH_FEATURES) {
+		strcpy(base->state, node->state);
+	} else {
+		fprintf(stderr, "Failed to get state for %s\n", devname);
+		return 1;
+	}
 
-int may_add_item(char *devname, struct list_head *head)
+	if (base->version == BCACHE_SB_VERSION_CDEV ||
+	    base->version == BCACHE_SB_VERSION_CDEV_WITH_UUID ||
+	    base->version == BCACHE_SB_VERSION_CDEV_WITH_FEATURES) {
+		strcpy(base->bname, BCACHE_NO_SUPPORT);
+		strcpy(base->attachuuid, BCACHE_NO_SUPPORT);
+	} else {
+		strcpy(base->bname, node->bname);
+		strcpy(base->attachuuid, node->attachuuid);
+	}
+	strcpy(base->paths, node->paths);
+	return 0;
+}
+
+
+static int add_item(struct topology *topo, struct topo_node *node,
+		    struct cache_sb_disk *sb_disk, struct list_head *head)
 {
-	struct cache_sb_disk sb_disk;
 	struct cache_sb sb;
 	char dev[512];
 	struct dev *tmp;
-	int ret = 0;
+	int ret;
 
-	if (strcmp(devname, ".") == 0 || strcmp(devname, "..") == 0)
+	if (memcmp(sb_disk->magic, bcache_magic, 16))
 		return 0;
 
-	sprintf(dev, "/dev/%s", devname);
-	int fd = open(dev, O_RDONLY);
-	if (fd == -1)
-		return 0;
+	sprintf(dev, "/dev/%s", node->name);
+	/* Listing never looks at the journal buckets */
+	to_cache_sb_head(&sb, sb_disk);
 
-	if (pread(fd, &sb_disk, sizeof(sb_disk), SB_START) != sizeof(sb_disk))
-		goto out;
-
-	if (memcmp(sb_disk.magic, bcache_magic, 16))
-		goto out;
-
-	to_cache_sb(&sb, &sb_disk);
-
-	tmp = (struct dev *) malloc(DEVLEN);
+	tmp = (struct dev *) calloc(1, DEVLEN);
 	if (tmp == NULL) {
 		fprintf(stderr, "Error: fail to allocate memory buffer\n");
-		ret = 1;
-		goto out;
+		return 1;
 	}
 
-	tmp->csum = le64_to_cpu(sb_disk.csum);
-	ret = detail_base(dev, sb, tmp);
+	tmp->csum = le64_to_cpu(sb_disk->csum);
+	ret = detail_base_topo(dev, &sb, tmp, topo, node);
 	if (ret != 0) {
 		fprintf(stderr, "Failed to get information for %s\n", dev);
 		free(tmp);
-		goto out;
+		return ret;
 	}
 	list_add_tail(&tmp->dev_list, head);
+	return 0;
+}
+
+/*
+ * Devices are probed by a pool of threads, each taking the next candidate
+ * from the array, so slow or spun-down disks are waited on concurrently
+ * instead of one after another. Every candidate collects its result in
+ * its own slot. As soon as a slot and all slots before it are complete
+ * their devices are handed on in /sys/block order, so the output doesn't
+ * depend on which probe finished first, yet doesn't have to wait for the
+ * slowest device either.
+ */
+#define SCAN_MAX_THREADS	32
+
+struct scan_slot {
+	struct topo_node	*node;
+	struct list_head	head;
+	int			ret;
+	bool			complete;	/* probed or from the sbcache */
+	bool			probed;	/* superblock area was read */
+	struct cache_sb_disk	*sb;	/* copy for the sbcache, if any */
+};
+
+struct scan_job {
+	struct topology		*topo;
+	bool			keep_sb;
+	struct scan_slot	*slots;	/* one per topology node, at most */
+	unsigned int		nr;
+	unsigned int		next;
+
+	pthread_mutex_t		lock;	/* protects the fields below */
+	unsigned int		emitted;
+	int			ret;
+	struct list_head	*out;
+	list_bdevs_fn		fn;
+	void			*arg;
+};
+
+/*
+ * The slots are allocated once for every node of the topology, before
+ * any is added: each holds a list head pointing into itself, so the
+ * array must never move.
+ */
+static void scan_add_candidate(struct scan_job *job, struct topo_node *node)
+{
+	struct scan_slot *slot = &job->slots[job->nr++];
+
+	slot->node = node;
+	INIT_LIST_HEAD(&slot->head);
+	slot->ret = 0;
+	slot->complete = false;
+	slot->probed = false;
+	slot->sb = NULL;
+}
+
+/* Record what was read for the sbcache and decode it */
+static int slot_add_item(struct scan_job *job, struct scan_slot *slot,
+			 struct cache_sb_disk *sb_disk)
+{
+	slot->probed = true;
+	if (job->keep_sb && !memcmp(sb_disk->magic, bcache_magic, 16)) {
+		slot->sb = malloc(sizeof(*slot->sb));
+		if (slot->sb)
+			*slot->sb = *sb_disk;
+		else
+			slot->probed = false;
+	}
+	return add_item(job->topo, slot->node, sb_disk, &slot->head);
+}
+
+static int may_add_item(struct scan_job *job, struct scan_slot *slot)
+{
+	struct cache_sb_disk sb_disk;
+	char dev[512];
+	int ret = 0;
+
+	sprintf(dev, "/dev/%s", slot->node->name);
+	int fd = open(dev, O_RDONLY);
+	if (fd == -1)
+		return 0;
+
+	if (pread(fd, &sb_disk, sizeof(sb_disk), SB_START) == sizeof(sb_disk))
+		ret = slot_add_item(job, slot, &sb_disk);
 
-out:
 	close(fd);
 	return ret;
 }
 
-int list_bdevs(struct list_head *head)
+/*
+ * Mark @slot complete and pass on the devices of every slot in the
+ * complete prefix of the job. After the first error nothing more is
+ * passed on.
+ */
+static void scan_complete(struct scan_job *job, struct scan_slot *slot)
 {
-	int ret;
-	DIR *dir, *subdir;
-	struct dirent *ptr, *subptr;
-	char path[300];
+	struct scan_slot *s;
+	struct dev *dev, *n;
 
-	dir = opendir("/sys/block");
-	if (dir == NULL) {
-		fprintf(stderr, "Unable to open dir /sys/block\n");
-		return 1;
+	pthread_mutex_lock(&job->lock);
+	slot->complete = true;
+	while (job->emitted < job->nr && job->slots[job->emitted].complete) {
+		s = &job->slots[job->emitted++];
+		if (job->ret == 0)
+			job->ret = s->ret;
+		list_for_each_entry_safe(dev, n, &s->head, dev_list) {
+			list_del(&dev->dev_list);
+			if (job->ret == 0 && job->fn)
+				job->ret = job->fn(dev, job->arg);
+			if (job->ret == 0)
+				list_add_tail(&dev->dev_list, job->out);
+			else
+				free(dev);
+		}
 	}
-	while ((ptr = readdir(dir)) != NULL) {
-		if (strcmp(ptr->d_name, ".") == 0
-			|| strcmp(ptr->d_name, "..") == 0)
+	pthread_mutex_unlock(&job->lock);
+}
+
+static void *scan_worker(void *arg)
+{
+	struct scan_job *job = arg;
+	struct scan_slot *slot;
+	unsigned int i;
+
+	while ((i = __sync_fetch_and_add(&job->next, 1)) < job->nr) {
+		slot = &job->slots[i];
+		if (slot->complete)
 			continue;
-		sprintf(path, "/sys/block/%s", ptr->d_name);
-		subdir = opendir(path);
-		if (subdir == NULL) {
-			fprintf(stderr, "Unable to open dir /sys/block\n");
-			return 1;
-		}
-		while ((subptr = readdir(subdir)) != NULL) {
-			if (strcmp(subptr->d_name, ".") == 0
-				|| strcmp(subptr->d_name, "..") == 0)
+		slot->ret = may_add_item(job, slot);
+		scan_complete(job, slot);
+	}
+	return NULL;
+}
+
+static void scan_run(struct scan_job *job)
+{
+	pthread_t threads[SCAN_MAX_THREADS];
+	unsigned int i, nr_threads, started;
+
+	nr_threads = job->nr < SCAN_MAX_THREADS ? job->nr : SCAN_MAX_THREADS;
+	for (started = 0; started < nr_threads; started++)
+		if (pthread_create(&threads[started], NULL, scan_worker, job))
+			break;
+
+	/* Whatever no thread picked up is probed here */
+	scan_worker(job);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+}
+
+/*
+ * io_uring engine: open a batch of candidates, queue all their superblock
+ * reads, submit them with a single system call and decode each superblock
+ * as its read completes. Discovery then takes about as long as the
+ * slowest device rather than the sum of all of them.
+ *
+ * Returns -1 if io_uring is unavailable, leaving the job untouched so the
+ * thread pool can run it instead.
+ */
+#define SCAN_URING_ENTRIES	256
+
+static int scan_run_uring(struct scan_job *job)
+{
+	struct cache_sb_disk *sbs;
+	struct scan_slot *slot;
+	struct uring *ring;
+	unsigned int i, batch, nr, queued, entries;
+	int fds[SCAN_URING_ENTRIES];
+	char dev[512];
+	uint64_t idx;
+	int res;
+
+	ring = uring_setup(job->nr < SCAN_URING_ENTRIES ?
+			   job->nr : SCAN_URING_ENTRIES);
+	if (ring == NULL)
+		return -1;
+	entries = uring_entries(ring);
+	if (entries > SCAN_URING_ENTRIES)
+		entries = SCAN_URING_ENTRIES;
+
+	sbs = malloc(entries * sizeof(*sbs));
+	if (sbs == NULL) {
+		uring_exit(ring);
+		return -1;
+	}
+
+	for (batch = 0; batch < job->nr; batch += nr) {
+		nr = job->nr - batch < entries ? job->nr - batch : entries;
+
+		queued = 0;
+		for (i = 0; i < nr; i++) {
+			slot = &job->slots[batch + i];
+			fds[i] = -1;
+			if (slot->complete)
+				continue;
+			sprintf(dev, "/dev/%s", slot->node->name);
+			fds[i] = open(dev, O_RDONLY);
+			if (fds[i] < 0) {
+				scan_complete(job, slot);
 				continue;
-			if (part_of_disk(ptr->d_name, subptr->d_name)) {
-				ret = may_add_item(subptr->d_name, head);
-				if (ret != 0)
-					return ret;
 			}
+			if (uring_prep_read(ring, fds[i], &sbs[i],
+					    sizeof(sbs[i]), SB_START, i) == 0) {
+				queued++;
+			} else {
+				slot->ret = may_add_item(job, slot);
+				scan_complete(job, slot);
+			}
+		}
+
+		if (uring_submit(ring) < 0)
+			goto fallback;
+
+		for (; queued; queued--) {
+			if (uring_wait(ring, &idx, &res) < 0)
+				goto fallback;
+			slot = &job->slots[batch + idx];
+			if (res == -EINVAL || res == -EOPNOTSUPP)
+				/* the kernel refused the read itself */
+				slot->ret = may_add_item(job, slot);
+			else if (res == sizeof(sbs[idx]))
+				slot->ret = slot_add_item(job, slot, &sbs[idx]);
+			scan_complete(job, slot);
 		}
-		ret = may_add_item(ptr->d_name, head);
-		if (ret != 0)
-			return ret;
+
+		for (i = 0; i < nr; i++)
+			if (fds[i] >= 0)
+				close(fds[i]);
 	}
-	closedir(dir);
+
+	free(sbs);
+	uring_exit(ring);
+	return 0;
+
+fallback:
+	/*
+	 * The ring broke down mid-batch. Closing it cancels what is left,
+	 * but reads still in flight may yet write into sbs, so that is only
+	 * freed if nothing was outstanding. Everything not complete yet
+	 * goes to the thread pool.
+	 */
+	uring_exit(ring);
+	if (!queued)
+		free(sbs);
+	for (i = 0; i < nr; i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+	for (i = batch; i < job->nr; i++) {
+		slot = &job->slots[i];
+		if (slot->complete)
+			continue;
+		free_dev(&slot->head);
+		INIT_LIST_HEAD(&slot->head);
+		slot->ret = 0;
+		slot->probed = false;
+		free(slot->sb);
+		slot->sb = NULL;
+	}
+	job->next = batch;
+	scan_run(job);
 	return 0;
 }
 
+/*
+ * Devices registered with the kernel are always read: the kernel
+ * rewrites their superblocks behind our back. So are devices on kernels
+ * without diskseq, where a media change can't be told apart.
+ */
+static bool sbcache_usable(struct topo_node *node)
+{
+	return node->diskseq && !node->has_bcache;
+}
+
+static void sbcache_key_of(struct topo_node *node, struct sbcache_key *key)
+{
+	memset(key, 0, sizeof(*key));
+	key->devt = node->devt;
+	key->diskseq = node->diskseq;
+	key->start = node->start;
+	key->size = node->size;
+}
+
+int list_bdevs_stream(struct list_head *head, unsigned int flags,
+		      list_bdevs_fn fn, void *arg)
+{
+	struct scan_filter filter;
+	struct sbcache old, new;
+	struct sbcache_entry *e;
+	struct sbcache_key key;
+	struct scan_slot *slot;
+	struct topology topo;
+	struct scan_job job;
+	unsigned int i;
+	bool dirty = false;
+	int ret;
+
+	/* A rescan doesn't trust the udev database either */
+	ret = scan_filter_load(&filter, !(flags & LIST_BDEVS_RESCAN));
+	if (ret != 0)
+		return ret;
+	ret = topo_scan(&topo);
+	if (ret != 0) {
+		scan_filter_free(&filter);
+		return ret;
+	}
+
+	if (flags & LIST_BDEVS_RESCAN)
+		memset(&old, 0, sizeof(old));
+	else
+		sbcache_load(&old);
+	memset(&new, 0, sizeof(new));
+
+	memset(&job, 0, sizeof(job));
+	job.topo = &topo;
+	job.keep_sb = true;
+	pthread_mutex_init(&job.lock, NULL);
+	job.out = head;
+	job.fn = fn;
+	job.arg = arg;
+	job.slots = calloc(topo.nr ? topo.nr : 1, sizeof(*job.slots));
+	if (job.slots == NULL) {
+		fprintf(stderr, "Error: fail to allocate memory buffer\n");
+		ret = 1;
+		goto out;
+	}
+	for (i = 0; i < topo.nr; i++) {
+		/* Each multipath LUN is read once, through its dm device */
+		if (topo.nodes[i].mpath_path && !topo.nodes[i].has_bcache)
+			continue;
+		if (!scan_filter_candidate(&filter, &topo.nodes[i]))
+			continue;
+		scan_add_candidate(&job, &topo.nodes[i]);
+		if (!sbcache_usable(&topo.nodes[i]))
+			continue;
+
+		sbcache_key_of(&topo.nodes[i], &key);
+		e = sbcache_lookup(&old, &key);
+		if (e == NULL || sbcache_add(&new, &key,
+					     e->has_sb ? &e->sb : NULL))
+			continue;
+		slot = &job.slots[job.nr - 1];
+		if (e->has_sb)
+			slot->ret = add_item(&topo, slot->node, &e->sb,
+					     &slot->head);
+		scan_complete(&job, slot);
+	}
+
+	if (scan_run_uring(&job) < 0)
+		scan_run(&job);
+	ret = job.ret;
+
+	for (i = 0; i < job.nr; i++) {
+		slot = &job.slots[i];
+		if (slot->probed && sbcache_usable(slot->node)) {
+			sbcache_key_of(slot->node, &key);
+			if (sbcache_add(&new, &key, slot->sb) == 0)
+				dirty = true;
+		}
+		free(slot->sb);
+	}
+
+	/* Only rewrite the file when something was read or went away */
+	if (ret == 0 && (dirty || new.nr != old.nr))
+		sbcache_save(&new);
+out:
+	if (ret != 0) {
+		for (i = 0; i < job.nr; i++)
+			free_dev(&job.slots[i].head);
+		free_dev(head);
+		INIT_LIST_HEAD(head);
+	}
+	pthread_mutex_destroy(&job.lock);
+	scan_filter_free(&filter);
+	sbcache_free(&old);
+	sbcache_free(&new);
+	free(job.slots);
+	topo_free(&topo);
+	return ret;
+}
+
+int list_bdevs(struct list_head *head, unsigned int flags)
+{
+	return list_bdevs_stream(head, flags, NULL, NULL);
+}
+
 int __detail_dev(char *devname, struct cache_sb_disk *sb_disk,
 		 struct bdev *bd, struct cdev *cd, int *type)
 {
@@ -513,7 +879,8 @@ int __detail_dev(char *devname, struct cache_sb_disk *sb_disk,
 	if (sb.version == BCACHE_SB_VERSION_BDEV ||
 	    sb.version == BCACHE_SB_VERSION_BDEV_WITH_OFFSET ||
 	    sb.version == BCACHE_SB_VERSION_BDEV_WITH_FEATURES) {
-		detail_base(devname, sb, &bd->base);
+		bd->sb = sb;
+		detail_base(devname, &sb, &bd->base);
 		bd->base.csum = expected_csum;
 		bd->first_sector = BDEV_DATA_START_DEFAULT;
 		bd->cache_mode = BDEV_CACHE_MODE(&sb);
@@ -521,7 +888,8 @@ int __detail_dev(char *devname, struct cache_sb_disk *sb_disk,
 	} else if (sb.version == BCACHE_SB_VERSION_CDEV ||
 		   sb.version == BCACHE_SB_VERSION_CDEV_WITH_UUID ||
 		   sb.version == BCACHE_SB_VERSION_CDEV_WITH_FEATURES) {
-		detail_base(devname, sb, &cd->base);
+		cd->sb = sb;
+		detail_base(devname, &sb, &cd->base);
 		cd->base.csum = expected_csum;
 		cd->first_sector = sb.bucket_size * sb.first_bucket;
 		cd->cache_sectors =
@@ -618,6 +986,7 @@ int unregister_cset(char *cset)
 		return 1;
 	}
 	close(fd);
+	sbcache_invalidate();
 	return 0;
 }
 
@@ -644,6 +1013,7 @@ int stop_backdev(char *devname)
 		return 1;
 	}
 	close(fd);
+	sbcache_invalidate();
 	return 0;
 }
 
@@ -665,6 +1035,7 @@ int unregister_both(char *cset)
 		return 1;
 	}
 	close(fd);
+	sbcache_invalidate();
 	return 0;
 }
 
@@ -806,8 +1177,13 @@ int set_label(char *devname, char *label)
 }
 
 
-struct cache_sb *to_cache_sb(struct cache_sb *sb,
-			     struct cache_sb_disk *sb_disk)
+/*
+ * Decode everything but the journal bucket array d[], which is most of
+ * the superblock and only needed by the tools that dump or rewrite it.
+ * sb->d is left untouched.
+ */
+struct cache_sb *to_cache_sb_head(struct cache_sb *sb,
+				  struct cache_sb_disk *sb_disk)
 {
 	/* Convert common part */
 	sb->offset = le64_to_cpu(sb_disk->offset);
@@ -833,22 +1209,21 @@ struct cache_sb *to_cache_sb(struct cache_sb *sb,
 		/* Backing device */
 		sb->data_offset = le64_to_cpu(sb_disk->data_offset);
 	} else {
-		int i;
-
 		/* Cache device */
 		sb->nbuckets = le64_to_cpu(sb_disk->nbuckets);
 		sb->nr_in_set = le16_to_cpu(sb_disk->nr_in_set);
 		sb->nr_this_dev = le16_to_cpu(sb_disk->nr_this_dev);
 		sb->bucket_size = le32_to_cpu(sb_disk->bucket_size);
-
-		for (i = 0; i < SB_JOURNAL_BUCKETS; i++)
-			sb->d[i]= le64_to_cpu(sb_disk->d[i]);
 	}
 
 	if (sb->version >= BCACHE_SB_VERSION_CDEV_WITH_FEATURES) {
 		sb->feature_compat = le64_to_cpu(sb_disk->feature_compat);
 		sb->feature_incompat = le64_to_cpu(sb_disk->feature_incompat);
 		sb->feature_ro_compat = le64_to_cpu(sb_disk->feature_ro_compat);
+	} else {
+		sb->feature_compat = 0;
+		sb->feature_incompat = 0;
+		sb->feature_ro_compat = 0;
 	}
 
 	if (sb->version >= BCACHE_SB_VERSION_CDEV_WITH_FEATURES) {
@@ -862,6 +1237,19 @@ struct cache_sb *to_cache_sb(struct cache_sb *sb,
 	return sb;
 }
 
+struct cache_sb *to_cache_sb(struct cache_sb *sb,
+			     struct cache_sb_disk *sb_disk)
+{
+	int i;
+
+	to_cache_sb_head(sb, sb_disk);
+	if (sb->version <= BCACHE_SB_MAX_VERSION && !SB_IS_BDEV(sb))
+		for (i = 0; i < SB_JOURNAL_BUCKETS; i++)
+			sb->d[i] = le64_to_cpu(sb_disk->d[i]);
+
+	return sb;
+}
+
 struct cache_sb_disk *to_cache_sb_disk(struct cache_sb_disk *sb_disk,
 				       struct cache_sb *sb)
 {
@@ -3,8 +3,8 @@
 
 #include "list.h"
 
+/* Summary of one device, as kept for every device when listing */
 struct dev {
-	struct cache_sb	sb;
 	char		name[40];
 	char		*magic;
 	uint64_t	first_sector;
@@ -21,11 +21,16 @@ struct dev {
 	uint64_t	feature_compat;
 	uint64_t	feature_ro_compat;
 	uint64_t	feature_incompat;
+	uint16_t	nr_in_set;	/* cache devices only */
+	uint16_t	nr_this_dev;
+	char		paths[128];	/* multipath paths, comma separated */
 	struct	list_head	dev_list;
 };
 
+/* Full details of a single device, with the whole decoded superblock */
 struct bdev {
 	struct dev	base;
+	struct cache_sb	sb;
 	uint16_t	first_sector;
 	uint8_t		cache_mode;
 	uint8_t		cache_state;
@@ -34,6 +39,7 @@ struct bdev {
 //typedef int bool;
 struct cdev {
 	struct dev	base;
+	struct cache_sb	sb;
 	uint16_t	first_sector;
 	uint64_t	cache_sectors;
 	uint64_t	total_sectors;
@@ -44,7 +50,19 @@ struct cdev {
 };
 
 
-int list_bdevs(struct list_head *head);
+/* list_bdevs() flags */
+#define LIST_BDEVS_RESCAN	(1U << 0)	/* ignore the superblock cache */
+
+int list_bdevs(struct list_head *head, unsigned int flags);
+/*
+ * Like list_bdevs(), but also calls @fn for every device, in the same
+ * order, as soon as it and all devices before it have been probed. @fn
+ * runs with the scan lock held, possibly on a scan thread; a non-zero
+ * return stops the listing and is returned.
+ */
+typedef int (*list_bdevs_fn)(struct dev *dev, void *arg);
+int list_bdevs_stream(struct list_head *head, unsigned int flags,
+		      list_bdevs_fn fn, void *arg);
 int detail_dev(char *devname, struct bdev *bd, struct cdev *cd, int *type);
 int register_dev(char *devname);
 int stop_backdev(char *devname);
@@ -55,6 +73,7 @@ int set_backdev_cachemode(char *devname, char *cachemode);
 int set_label(char *devname, char *label);
 int cset_to_devname(struct list_head *head, char *cset, char *devname);
 struct cache_sb *to_cache_sb(struct cache_sb *sb, struct cache_sb_disk *sb_disk);
+struct cache_sb *to_cache_sb_head(struct cache_sb *sb, struct cache_sb_disk *sb_disk);
 struct cache_sb_disk *to_cache_sb_disk(struct cache_sb_disk *sb_disk,struct cache_sb *sb);
 void set_bucket_size(struct cache_sb *sb, unsigned int bucket_size);
 void free_dev(struct list_head *head);
@@ -71,3 +90,5 @@ bool accepted_char(char c);
 #define BCACHE_ATTACH_ALONE		"Alone"
 #define BCACHE_BNAME_NOT_EXIST		"Non-Exist"
 #define DEV_PREFIX_LEN			5
+/* Longest kernel name (/dev/ trimmed) the management helpers can hold */
+#define DEV_KNAME_MAX			19
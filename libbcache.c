@@ -0,0 +1,460 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * libbcache: the public, stable face of lib.c. Everything here is a thin
+ * layer over the functions the bcache tool itself uses; see libbcache.h
+ * for the interface. Only bcache_* symbols are exported from the shared
+ * library (libbcache.map).
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bcache.h"
+#include "lib.h"
+#include "libbcache.h"
+
+struct bcache_dev {
+	struct dev	base;
+	bool		opened;
+	int		cache_mode;
+	int		cache_state;
+	int64_t		cache_sectors;
+	int64_t		total_sectors;
+};
+
+struct bcache_devlist {
+	struct bcache_dev	*devs;
+	unsigned int		nr;
+};
+
+static bool version_is_bdev(uint64_t version)
+{
+	return version == BCACHE_SB_VERSION_BDEV ||
+	       version == BCACHE_SB_VERSION_BDEV_WITH_OFFSET ||
+	       version == BCACHE_SB_VERSION_BDEV_WITH_FEATURES;
+}
+
+static bool version_is_cdev(uint64_t version)
+{
+	return version == BCACHE_SB_VERSION_CDEV ||
+	       version == BCACHE_SB_VERSION_CDEV_WITH_UUID ||
+	       version == BCACHE_SB_VERSION_CDEV_WITH_FEATURES;
+}
+
+/*
+ * lib.c takes mutable strings, callers of the API hand us const ones.
+ * It also keeps names in buffers sized for /dev/<kernel name>, so names
+ * are resolved and checked the way the bcache tool's bad_dev() does,
+ * and anything else is refused with -EINVAL.
+ */
+static int copy_name(char *dest, const char *src)
+{
+	char *real, *kname;
+	size_t len;
+
+	real = realpath(src, NULL);
+	if (real == NULL) {
+		fprintf(stderr, "Error: failed to resolve %s: %m\n", src);
+		return -EINVAL;
+	}
+	kname = real + DEV_PREFIX_LEN;
+	len = strlen(real) < DEV_PREFIX_LEN ? 0 : strlen(kname);
+	if (strncmp(real, "/dev/", DEV_PREFIX_LEN) || !len ||
+	    len > DEV_KNAME_MAX ||
+	    strspn(kname, "abcdefghijklmnopqrstuvwxyz"
+			  "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-") != len) {
+		fprintf(stderr, "Error: %s is not a usable device name\n", src);
+		free(real);
+		return -EINVAL;
+	}
+	strcpy(dest, real);
+	free(real);
+	return 0;
+}
+
+/* lib.c explains its failures on stderr and returns non-zero */
+static int lib_ret(int ret)
+{
+	return ret ? -EIO : 0;
+}
+
+/* A cache set uuid, as opposed to a cache device */
+static bool is_cset_uuid(const char *s)
+{
+	return strlen(s) == 36 &&
+	       strspn(s, "0123456789abcdef-") == 36;
+}
+
+int bcache_api_version(void)
+{
+	return LIBBCACHE_API_VERSION;
+}
+
+int bcache_list(struct bcache_devlist **list, unsigned int flags)
+{
+	struct bcache_devlist *l;
+	struct list_head head;
+	struct dev *dev, *n;
+	unsigned int nr = 0;
+	int ret;
+
+	INIT_LIST_HEAD(&head);
+	ret = list_bdevs(&head, flags & BCACHE_LIST_RESCAN ?
+			 LIST_BDEVS_RESCAN : 0);
+	if (ret != 0)
+		return lib_ret(ret);
+
+	list_for_each_entry(dev, &head, dev_list)
+		nr++;
+
+	l = calloc(1, sizeof(*l));
+	if (l)
+		l->devs = calloc(nr ? nr : 1, sizeof(*l->devs));
+	if (l == NULL || l->devs == NULL) {
+		fprintf(stderr, "Error: fail to allocate memory buffer\n");
+		free(l);
+		free_dev(&head);
+		return -ENOMEM;
+	}
+
+	list_for_each_entry_safe(dev, n, &head, dev_list) {
+		struct bcache_dev *d = &l->devs[l->nr++];
+
+		d->base = *dev;
+		INIT_LIST_HEAD(&d->base.dev_list);
+		d->cache_mode = -1;
+		d->cache_state = -1;
+		d->cache_sectors = -1;
+		d->total_sectors = -1;
+	}
+	free_dev(&head);
+
+	*list = l;
+	return 0;
+}
+
+unsigned int bcache_list_count(const struct bcache_devlist *list)
+{
+	return list->nr;
+}
+
+const struct bcache_dev *bcache_list_get(const struct bcache_devlist *list,
+					 unsigned int i)
+{
+	return i < list->nr ? &list->devs[i] : NULL;
+}
+
+void bcache_list_free(struct bcache_devlist *list)
+{
+	if (list == NULL)
+		return;
+	free(list->devs);
+	free(list);
+}
+
+int bcache_dev_open(struct bcache_dev **dev, const char *devname)
+{
+	char name[PATH_MAX];
+	struct bcache_dev *d;
+	struct bdev bd;
+	struct cdev cd;
+	int type = 0;
+	int ret;
+
+	ret = copy_name(name, devname);
+	if (ret != 0)
+		return ret;
+	ret = detail_dev(name, &bd, &cd, &type);
+	if (ret != 0)
+		return lib_ret(ret);
+
+	d = calloc(1, sizeof(*d));
+	if (d == NULL) {
+		fprintf(stderr, "Error: fail to allocate memory buffer\n");
+		return -ENOMEM;
+	}
+
+	d->opened = true;
+	d->cache_mode = -1;
+	d->cache_state = -1;
+	d->cache_sectors = -1;
+	d->total_sectors = -1;
+	if (version_is_bdev(type)) {
+		d->base = bd.base;
+		d->cache_mode = bd.cache_mode;
+		d->cache_state = bd.cache_state;
+	} else {
+		d->base = cd.base;
+		d->cache_sectors = cd.cache_sectors;
+		d->total_sectors = cd.total_sectors;
+	}
+	INIT_LIST_HEAD(&d->base.dev_list);
+
+	*dev = d;
+	return 0;
+}
+
+void bcache_dev_free(struct bcache_dev *dev)
+{
+	free(dev);
+}
+
+const char *bcache_dev_name(const struct bcache_dev *dev)
+{
+	return dev->base.name;
+}
+
+enum bcache_dev_type bcache_dev_type(const struct bcache_dev *dev)
+{
+	if (version_is_bdev(dev->base.version))
+		return BCACHE_DEV_BACKING;
+	if (version_is_cdev(dev->base.version))
+		return BCACHE_DEV_CACHE;
+	return BCACHE_DEV_UNKNOWN;
+}
+
+uint64_t bcache_dev_sb_version(const struct bcache_dev *dev)
+{
+	return dev->base.version;
+}
+
+uint64_t bcache_dev_csum(const struct bcache_dev *dev)
+{
+	return dev->base.csum;
+}
+
+const char *bcache_dev_uuid(const struct bcache_dev *dev)
+{
+	return dev->base.uuid;
+}
+
+const char *bcache_dev_cset_uuid(const struct bcache_dev *dev)
+{
+	return dev->base.cset;
+}
+
+const char *bcache_dev_label(const struct bcache_dev *dev)
+{
+	return dev->base.label;
+}
+
+unsigned int bcache_dev_block_sectors(const struct bcache_dev *dev)
+{
+	return dev->base.sectors_per_block;
+}
+
+unsigned int bcache_dev_bucket_sectors(const struct bcache_dev *dev)
+{
+	return dev->base.sectors_per_bucket;
+}
+
+const char *bcache_dev_state(const struct bcache_dev *dev)
+{
+	return dev->base.state;
+}
+
+const char *bcache_dev_bname(const struct bcache_dev *dev)
+{
+	return dev->base.bname;
+}
+
+const char *bcache_dev_attach_uuid(const struct bcache_dev *dev)
+{
+	return dev->base.attachuuid;
+}
+
+const char *bcache_dev_paths(const struct bcache_dev *dev)
+{
+	return dev->base.paths;
+}
+
+unsigned int bcache_dev_nr_in_set(const struct bcache_dev *dev)
+{
+	return dev->base.nr_in_set;
+}
+
+unsigned int bcache_dev_nr_this_dev(const struct bcache_dev *dev)
+{
+	return dev->base.nr_this_dev;
+}
+
+int bcache_dev_cache_mode(const struct bcache_dev *dev)
+{
+	return dev->cache_mode;
+}
+
+int bcache_dev_cache_state(const struct bcache_dev *dev)
+{
+	return dev->cache_state;
+}
+
+int64_t bcache_dev_cache_sectors(const struct bcache_dev *dev)
+{
+	return dev->cache_sectors;
+}
+
+int64_t bcache_dev_total_sectors(const struct bcache_dev *dev)
+{
+	return dev->total_sectors;
+}
+
+int bcache_register(const char *devname)
+{
+	char name[PATH_MAX];
+	int ret;
+
+	ret = copy_name(name, devname);
+	if (ret != 0)
+		return ret;
+	return lib_ret(register_dev(name));
+}
+
+/* Stops a backing device, or unregisters the cache set of a cache device */
+int bcache_unregister(const char *devname)
+{
+	char name[PATH_MAX];
+	struct bdev bd;
+	struct cdev cd;
+	int type = 1;
+	int ret;
+
+	ret = copy_name(name, devname);
+	if (ret != 0)
+		return ret;
+	ret = detail_dev(name, &bd, &cd, &type);
+	if (ret != 0)
+		return lib_ret(ret);
+	if (version_is_bdev(type))
+		return lib_ret(stop_backdev(name));
+	else if (version_is_cdev(type))
+		return lib_ret(unregister_cset(cd.base.cset));
+	return -EINVAL;
+}
+
+/* Backing device checks shared by set-cachemode and set-label */
+static int check_backdev(char *name)
+{
+	struct bdev bd;
+	struct cdev cd;
+	int type = 1;
+	int ret;
+
+	ret = detail_dev(name, &bd, &cd, &type);
+	if (ret != 0) {
+		fprintf(stderr,
+		"This device doesn't exist or failed to receive info from this device\n");
+		return lib_ret(ret);
+	}
+	if (type != BCACHE_SB_VERSION_BDEV
+	    && type != BCACHE_SB_VERSION_BDEV_WITH_OFFSET) {
+		fprintf(stderr, "Only backend device is suppported\n");
+		return -EINVAL;
+	}
+	return 0;
+}
+
+int bcache_attach(const char *cset_or_cachedev, const char *devname)
+{
+	char backdev[PATH_MAX], cdev[PATH_MAX];
+	char cset[40];
+	struct bdev bd;
+	struct cdev cd;
+	int type = 1;
+	int ret;
+
+	ret = copy_name(backdev, devname);
+	if (ret != 0)
+		return ret;
+	if (is_cset_uuid(cset_or_cachedev))
+		strcpy(cdev, cset_or_cachedev);
+	else {
+		ret = copy_name(cdev, cset_or_cachedev);
+		if (ret != 0)
+			return ret;
+	}
+
+	ret = detail_dev(backdev, &bd, &cd, &type);
+	if (ret != 0)
+		return lib_ret(ret);
+	if (type != BCACHE_SB_VERSION_BDEV
+	    && type != BCACHE_SB_VERSION_BDEV_WITH_OFFSET) {
+		fprintf(stderr, "%s is not an backend device\n", backdev);
+		return -EINVAL;
+	}
+	if (strcmp(bd.base.attachuuid, BCACHE_BNAME_NOT_EXIST) != 0) {
+		fprintf(stderr,
+			"This device have attached to another cset\n");
+		return -EBUSY;
+	}
+
+	if (strlen(cdev) != 36) {
+		ret = detail_dev(cdev, &bd, &cd, &type);
+		if (ret != 0)
+			return lib_ret(ret);
+		if (type != BCACHE_SB_VERSION_CDEV
+		    && type != BCACHE_SB_VERSION_CDEV_WITH_UUID) {
+			fprintf(stderr, "%s is not an cache device\n", cdev);
+			return -EINVAL;
+		}
+		strcpy(cset, cd.base.cset);
+	} else {
+		strcpy(cset, cdev);
+	}
+	return lib_ret(attach_backdev(cset, backdev));
+}
+
+int bcache_detach(const char *devname)
+{
+	char name[PATH_MAX];
+	int ret;
+
+	ret = copy_name(name, devname);
+	if (ret != 0)
+		return ret;
+	return lib_ret(detach_backdev(name));
+}
+
+int bcache_set_cachemode(const char *devname, const char *cachemode)
+{
+	char name[PATH_MAX], mode[32];
+	int ret;
+
+	ret = copy_name(name, devname);
+	if (ret != 0)
+		return ret;
+	if (strlen(cachemode) >= sizeof(mode)) {
+		fprintf(stderr, "Unknown cache mode %s\n", cachemode);
+		return -EINVAL;
+	}
+	strcpy(mode, cachemode);
+
+	ret = check_backdev(name);
+	if (ret != 0)
+		return ret;
+	return lib_ret(set_backdev_cachemode(name, mode));
+}
+
+int bcache_set_label(const char *devname, const char *label)
+{
+	char name[PATH_MAX], buf[SB_LABEL_SIZE];
+	int ret;
+
+	ret = copy_name(name, devname);
+	if (ret != 0)
+		return ret;
+
+	ret = check_backdev(name);
+	if (ret != 0)
+		return ret;
+	if (strlen(label) >= SB_LABEL_SIZE) {
+		fprintf(stderr, "Label is too long\n");
+		return -EINVAL;
+	}
+	strcpy(buf, label);
+	return lib_ret(set_label(name, buf));
+}
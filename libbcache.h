@@ -0,0 +1,108 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * libbcache - find, inspect and manage bcache devices from C.
+ *
+ * This is the interface the bcache command line tool is built on, for
+ * programs that would otherwise run `bcache show` and parse its output.
+ * All handles are opaque; strings returned by accessors belong to the
+ * handle and stay valid until it is freed.
+ *
+ * Functions returning int return 0 on success and a negative errno on
+ * failure, and explain failures on stderr: -EINVAL for arguments that
+ * don't name a suitable device, -ENOMEM, -EBUSY for a backing device
+ * that is already attached and -EIO when reading or managing the device
+ * failed. Managing devices needs the same privileges as the tool,
+ * normally root.
+ *
+ * Device names may be any path to a block device, such as a
+ * /dev/disk/by-id link; they are resolved to /dev/<kernel name> first.
+ * Names that don't resolve to one give -EINVAL.
+ */
+
+#ifndef _LIBBCACHE_H
+#define _LIBBCACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LIBBCACHE_API_VERSION	1
+
+/* One device carrying a bcache superblock */
+struct bcache_dev;
+/* Every bcache device found on the host */
+struct bcache_devlist;
+
+enum bcache_dev_type {
+	BCACHE_DEV_UNKNOWN,
+	BCACHE_DEV_BACKING,
+	BCACHE_DEV_CACHE,
+};
+
+/* bcache_list() flags */
+#define BCACHE_LIST_RESCAN	(1U << 0)	/* don't trust /run/bcache/sbcache */
+
+/* API version the library was built with, LIBBCACHE_API_VERSION */
+int bcache_api_version(void);
+
+/*
+ * Scan the host for bcache devices. Devices are in /sys/block order,
+ * partitions before their disk, like `bcache show`.
+ */
+int bcache_list(struct bcache_devlist **list, unsigned int flags);
+unsigned int bcache_list_count(const struct bcache_devlist *list);
+const struct bcache_dev *bcache_list_get(const struct bcache_devlist *list,
+					 unsigned int i);
+void bcache_list_free(struct bcache_devlist *list);
+
+/*
+ * Read and verify the superblock of @devname (a /dev path), like
+ * `bcache show -d`. Fails if it isn't a valid bcache device.
+ */
+int bcache_dev_open(struct bcache_dev **dev, const char *devname);
+void bcache_dev_free(struct bcache_dev *dev);
+
+/* Available on every device, listed or opened */
+const char *bcache_dev_name(const struct bcache_dev *dev);
+enum bcache_dev_type bcache_dev_type(const struct bcache_dev *dev);
+uint64_t bcache_dev_sb_version(const struct bcache_dev *dev);
+uint64_t bcache_dev_csum(const struct bcache_dev *dev);
+const char *bcache_dev_uuid(const struct bcache_dev *dev);
+const char *bcache_dev_cset_uuid(const struct bcache_dev *dev);
+const char *bcache_dev_label(const struct bcache_dev *dev);
+unsigned int bcache_dev_block_sectors(const struct bcache_dev *dev);
+unsigned int bcache_dev_bucket_sectors(const struct bcache_dev *dev);
+/* "active"/"inactive" or the kernel's backing device state */
+const char *bcache_dev_state(const struct bcache_dev *dev);
+/* bcacheN of a running backing device, "Non-Exist" or "N/A" */
+const char *bcache_dev_bname(const struct bcache_dev *dev);
+/* cache set a backing device is attached to, "Non-Exist" or "N/A" */
+const char *bcache_dev_attach_uuid(const struct bcache_dev *dev);
+/* paths of a multipath device ("sdb,sdc"), empty for anything else */
+const char *bcache_dev_paths(const struct bcache_dev *dev);
+/* cache devices in the set and this one's index, 0 on backing devices */
+unsigned int bcache_dev_nr_in_set(const struct bcache_dev *dev);
+unsigned int bcache_dev_nr_this_dev(const struct bcache_dev *dev);
+
+/* Only on opened devices, -1 where they don't apply */
+int bcache_dev_cache_mode(const struct bcache_dev *dev);
+int bcache_dev_cache_state(const struct bcache_dev *dev);
+int64_t bcache_dev_cache_sectors(const struct bcache_dev *dev);
+int64_t bcache_dev_total_sectors(const struct bcache_dev *dev);
+
+/* Management, the equivalents of the bcache subcommands */
+int bcache_register(const char *devname);
+int bcache_unregister(const char *devname);
+int bcache_attach(const char *cset_or_cachedev, const char *devname);
+int bcache_detach(const char *devname);
+int bcache_set_cachemode(const char *devname, const char *cachemode);
+int bcache_set_label(const char *devname, const char *label);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -21,6 +21,7 @@
 #include <getopt.h>
 #include <limits.h>
 #include <linux/fs.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -29,6 +30,8 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <uuid/uuid.h>
 
@@ -36,12 +39,18 @@
 #include "lib.h"
 #include "bitwise.h"
 #include "zoned.h"
+#include "sbcache.h"
+#include "discard.h"
+#include "geometry.h"
 
 struct sb_context {
 	unsigned int	block_size;
 	unsigned int	bucket_size;
-	bool		writeback;
+	unsigned int	cache_mode;
+	unsigned int	nr_in_set;
+	unsigned int	nr_this_dev;
 	bool		discard;
+	struct discard_opts	discard_opts;
 	bool		wipe_bcache;
 	unsigned int	cache_replacement_policy;
 	uint64_t	data_offset;
@@ -182,10 +191,16 @@ void usage(void)
 //	       "	-U			UUID\n"
 	       "	    --writeback		enable writeback\n"
 	       "	    --discard		enable discards\n"
+	       "	    --discard-mode	(auto|discard|zeroout|secure|punch)\n"
+	       "	    --discard-rate	limit the initial discard to this many bytes/s\n"
+	       "	    --discard-jobs	threads issuing the initial discard\n"
 	       "	    --force		reformat a bcache device even if it is running\n"
 	       "	-l, --label		set label for device\n"
+	       "	-j, --jobs		format up to this many devices at once\n"
 	       "	    --cache_replacement_policy=(lru|fifo)\n"
 		   "	    --ioctl		Communicate via IOCTL with the control device\n"
+	       "	    --auto-geometry	pick block and bucket size from the devices' I/O limits\n"
+	       "	    --manifest		format the cache sets described in this file\n"
 	       "	-h, --help		display this help and exit\n");
 	exit(EXIT_FAILURE);
 }
@@ -197,55 +212,12 @@ const char * const cache_replacement_policies[] = {
 	NULL
 };
 
-int blkdiscard_all(char *path, int fd)
-{
-	printf("%s blkdiscard beginning...", path);
-	fflush(stdout);
-
-	uint64_t end, blksize, secsize, range[2];
-	struct stat sb;
-
-	range[0] = 0;
-	range[1] = ULLONG_MAX;
-
-	if (fstat(fd, &sb) == -1)
-		goto err;
-
-	if (!S_ISBLK(sb.st_mode))
-		goto err;
-
-	if (ioctl(fd, BLKGETSIZE64, &blksize))
-		goto err;
-
-	if (ioctl(fd, BLKSSZGET, &secsize))
-		goto err;
-
-	/* align range to the sector size */
-	range[0] = (range[0] + secsize - 1) & ~(secsize - 1);
-	range[1] &= ~(secsize - 1);
-
-	/* is the range end behind the end of the device ?*/
-	end = range[0] + range[1];
-	if (end < range[0] || end > blksize)
-		range[1] = blksize - range[0];
-
-	if (ioctl(fd, BLKDISCARD, &range))
-		goto err;
-
-	printf("done\n");
-	return 0;
-err:
-	printf("\r                                ");
-	return -1;
-}
-
 static void write_sb_common(char *dev, struct cache_sb *sb, struct sb_context *sbc,
 	bool bdev, unsigned long long nbuckets)
 {
 	char uuid_str[40], set_uuid_str[40];
 	unsigned int block_size = sbc->block_size;
 	unsigned int bucket_size = sbc->bucket_size;
-	bool writeback = sbc->writeback;
 	bool discard = sbc->discard;
 	char *label = sbc->label;
 	uint64_t data_offset = sbc->data_offset;
@@ -268,8 +240,7 @@ static void write_sb_common(char *dev, struct cache_sb *sb, struct sb_context *s
 	uuid_unparse(sb->set_uuid, set_uuid_str);
 
 	if (SB_IS_BDEV(sb)) {
-		SET_BDEV_CACHE_MODE(sb, writeback ?
-			CACHE_MODE_WRITEBACK : CACHE_MODE_WRITETHROUGH);
+		SET_BDEV_CACHE_MODE(sb, sbc->cache_mode);
 
 		/*
 		 * Currently bcache does not support writeback mode for
@@ -307,8 +278,13 @@ static void write_sb_common(char *dev, struct cache_sb *sb, struct sb_context *s
 		set_bucket_size(sb, bucket_size);
 
 		sb->nbuckets		= nbuckets;
-		sb->nr_in_set		= 1;
-		/* 23 is (SB_SECTOR + SB_SIZE) - 1 sectors */
+		sb->nr_in_set		= sbc->nr_in_set;
+		sb->nr_this_dev		= sbc->nr_this_dev;
+		/*
+		 * 23 is (SB_SECTOR + SB_SIZE) - 1 sectors. With zone sized
+		 * buckets on zoned devices this is bucket 1, so zone 0 only
+		 * holds the superblock and buckets start on zone boundaries.
+		 */
 		sb->first_bucket		= (23 / sb->bucket_size) + 1;
 
 		if (sb->nbuckets < 1 << 7) {
@@ -354,13 +330,36 @@ static void write_sb_common(char *dev, struct cache_sb *sb, struct sb_context *s
 
 }
 
+/*
+ * Whether @fd carries a superblock or partition table other than bcache's
+ * (which blkid knows too, so it has to be wiped first).
+ * returns 0 if not, 1 if it does, -1 if it couldn't be probed
+ */
+static int probe_other_sb(int fd)
+{
+	blkid_probe pr;
+	int ret = -1;
+
+	pr = blkid_new_probe();
+	if (!pr)
+		return -1;
+	if (blkid_probe_set_device(pr, fd, 0, 0))
+		goto out;
+	/* enable ptable probing; superblock probing is enabled by default */
+	if (blkid_probe_enable_partitions(pr, true))
+		goto out;
+	ret = !blkid_do_probe(pr);
+out:
+	blkid_free_probe(pr);
+	return ret;
+}
+
 static void write_sb(char *dev, struct sb_context *sbc, bool bdev, bool force)
 {
 	int fd;
 	char zeroes[SB_START] = {0};
 	struct cache_sb_disk sb_disk;
 	struct cache_sb sb;
-	blkid_probe pr;
 	uint64_t nbuckets;
 	bool wipe_bcache = sbc->wipe_bcache;
 	bool discard = sbc->discard;
@@ -420,6 +419,9 @@ static void write_sb(char *dev, struct sb_context *sbc, bool bdev, bool force)
 	if (force)
 		wipe_bcache = true;
 
+	/* The cached superblock of this device is about to go stale */
+	sbcache_invalidate();
+
 	if (pread(fd, &sb_disk, sizeof(sb_disk), SB_START) != sizeof(sb_disk))
 		exit(EXIT_FAILURE);
 
@@ -439,20 +441,17 @@ static void write_sb(char *dev, struct sb_context *sbc, bool bdev, bool force)
 			exit(EXIT_FAILURE);
 		}
 	}
-	pr = blkid_new_probe();
-	if (!pr)
-		exit(EXIT_FAILURE);
-	if (blkid_probe_set_device(pr, fd, 0, 0))
-		exit(EXIT_FAILURE);
-	/* enable ptable probing; superblock probing is enabled by default */
-	if (blkid_probe_enable_partitions(pr, true))
-		exit(EXIT_FAILURE);
-	if (!blkid_do_probe(pr)) {
+	switch (probe_other_sb(fd)) {
+	case 0:
+		break;
+	case 1:
 		/* XXX wipefs doesn't know how to remove partition tables */
 		fprintf(stderr,
 			"Device %s already has a non-bcache superblock,", dev);
 		fprintf(stderr,	"remove it using wipefs and wipefs -a\n");
 		exit(EXIT_FAILURE);
+	default:
+		exit(EXIT_FAILURE);
 	}
 
 	memset(&sb_disk, 0, sizeof(struct cache_sb_disk));
@@ -464,7 +463,7 @@ static void write_sb(char *dev, struct sb_context *sbc, bool bdev, bool force)
 	if (!SB_IS_BDEV(&sb)) {
 		/* Attempting to discard cache device */
 		if (discard)
-			blkdiscard_all(dev, fd);
+			discard_dev(dev, fd, &sbc->discard_opts);
 	}
 
 	/*
@@ -475,14 +474,37 @@ static void write_sb(char *dev, struct sb_context *sbc, bool bdev, bool force)
 
 	/* write csum */
 	sb_disk.csum = cpu_to_le64(csum_set(&sb_disk));
-	/* Zero start of disk */
-	if (pwrite(fd, zeroes, SB_START, 0) != SB_START) {
-		perror("write error\n");
-		exit(EXIT_FAILURE);
+	/*
+	 * Zero start of disk. A zone 0 with a write pointer is reset
+	 * instead, which empties it, and written from its start in one go.
+	 */
+	switch (reset_zone0(fd)) {
+	case 0: {
+		char start[SB_START + sizeof(sb_disk)];
+
+		memset(start, 0, SB_START);
+		memcpy(start + SB_START, &sb_disk, sizeof(sb_disk));
+		if (pwrite(fd, start, sizeof(start), 0) != sizeof(start)) {
+			perror("write error\n");
+			exit(EXIT_FAILURE);
+		}
+		break;
 	}
-	/* Write superblock */
-	if (pwrite(fd, &sb_disk, sizeof(sb_disk), SB_START) != sizeof(sb_disk)) {
-		perror("write error\n");
+	case 1:
+		if (pwrite(fd, zeroes, SB_START, 0) != SB_START) {
+			perror("write error\n");
+			exit(EXIT_FAILURE);
+		}
+		/* Write superblock */
+		if (pwrite(fd, &sb_disk, sizeof(sb_disk), SB_START) !=
+		    sizeof(sb_disk)) {
+			perror("write error\n");
+			exit(EXIT_FAILURE);
+		}
+		break;
+	default:
+		fprintf(stderr, "Failed to reset zone 0 of %s: %s\n",
+			dev, strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 
@@ -546,6 +568,7 @@ static void write_sb_ioctl(char *dev, struct sb_context *sbc, bool bdev, bool fo
 
 	write_sb_common(dev, &cmd.sb, sbc, bdev, dev_blocks/sbc->bucket_size);
 
+	sbcache_invalidate();
 	if (ioctl(fd, BCH_IOCTL_REGISTER_DEVICE, &cmd) < 0) {
 		fprintf(stderr, "Error during ioctl operation: %s\n", strerror(errno));
 		close(fd);
@@ -597,6 +620,713 @@ static unsigned int get_blocksize(const char *path)
 	return statbuf.st_blksize / 512;
 }
 
+/*
+ * With several devices on the command line each one is formatted by its
+ * own child process, at most max_jobs at a time: most of the time goes
+ * into probing, discarding and fsyncing, which the disks can do side by
+ * side. write_sb() and friends exit() on any error, which a child keeps to
+ * its own device. The output of every child is captured and printed in
+ * command line order once it's done, so it isn't interleaved.
+ */
+struct format_job {
+	char		*dev;
+	bool		bdev;
+	struct sb_context sbc;
+	pid_t		pid;
+	FILE		*out;
+	FILE		*err;
+	struct timespec	start;
+	double		secs;
+	int		status;
+	bool		started;
+	bool		done;
+};
+
+/*
+ * Zoned and striped backing devices adjust their own data_offset, before
+ * anything is formatted.
+ * returns 0, or 1 if the device can't be used as a backing device
+ */
+static int set_data_offset(struct format_job *job)
+{
+	if (check_data_offset_for_zoned_device(job->dev,
+					       &job->sbc.data_offset))
+		return 1;
+	if (!is_zoned_device(job->dev))
+		check_data_offset_for_stripe(job->dev, &job->sbc.data_offset);
+	return 0;
+}
+
+static void format_one(struct format_job *job, bool force, bool use_ioctl)
+{
+	struct sb_context *sbc = &job->sbc;
+
+	if (!job->bdev) {
+		if (use_ioctl) {
+			fprintf(stderr, "WARNING. Cache devices should use the normal way!\n");
+		}
+		write_sb(job->dev, sbc, false, force);
+		return;
+	}
+
+	if (use_ioctl) {
+		write_sb_ioctl(job->dev, sbc, true, force);
+	} else {
+		write_sb(job->dev, sbc, true, force);
+	}
+}
+
+static int format_start(struct format_job *job, bool force, bool use_ioctl)
+{
+	job->out = tmpfile();
+	job->err = tmpfile();
+	if (job->out == NULL || job->err == NULL) {
+		fprintf(stderr, "Can't create output buffer for %s: %s\n",
+			job->dev, strerror(errno));
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &job->start);
+	job->pid = fork();
+	if (job->pid < 0) {
+		fprintf(stderr, "Can't fork to format %s: %s\n",
+			job->dev, strerror(errno));
+		return 1;
+	}
+	if (job->pid == 0) {
+		if (dup2(fileno(job->out), STDOUT_FILENO) < 0 ||
+		    dup2(fileno(job->err), STDERR_FILENO) < 0)
+			_exit(EXIT_FAILURE);
+		format_one(job, force, use_ioctl);
+		exit(EXIT_SUCCESS);
+	}
+	job->started = true;
+	return 0;
+}
+
+static void copy_output(FILE *from, FILE *to)
+{
+	char buf[4096];
+	size_t n;
+
+	rewind(from);
+	while ((n = fread(buf, 1, sizeof(buf), from)) > 0)
+		fwrite(buf, 1, n, to);
+	fclose(from);
+	fflush(to);
+}
+
+static void format_emit(struct format_job *job)
+{
+	copy_output(job->out, stdout);
+	copy_output(job->err, stderr);
+}
+
+static bool format_ok(struct format_job *job)
+{
+	return job->done && WIFEXITED(job->status) &&
+	       WEXITSTATUS(job->status) == EXIT_SUCCESS;
+}
+
+static void format_summary(struct format_job *jobs, unsigned int nr)
+{
+	unsigned int i;
+
+	printf("Device			Type	Time	Result\n");
+	for (i = 0; i < nr; i++) {
+		struct format_job *job = &jobs[i];
+
+		printf("%-24s%s\t", job->dev, job->bdev ? "data" : "cache");
+		if (!job->done)
+			printf("-\tskipped\n");
+		else if (format_ok(job))
+			printf("%.2fs\tok\n", job->secs);
+		else if (WIFSIGNALED(job->status))
+			printf("%.2fs\tkilled by signal %d\n", job->secs,
+			       WTERMSIG(job->status));
+		else
+			printf("%.2fs\tfailed\n", job->secs);
+	}
+}
+
+static int format_devices(struct format_job *jobs, unsigned int nr,
+			  unsigned int max_jobs, bool force, bool use_ioctl)
+{
+	unsigned int next = 0, running = 0, emitted = 0, i;
+	struct timespec now;
+	bool failed = false;
+	int status;
+	pid_t pid;
+
+	/* Children must not inherit anything still buffered */
+	fflush(stdout);
+	fflush(stderr);
+
+	while (emitted < nr) {
+		/* Once a device failed no more are started, like before */
+		while (!failed && running < max_jobs && next < nr) {
+			if (format_start(&jobs[next], force, use_ioctl)) {
+				failed = true;
+				break;
+			}
+			next++;
+			running++;
+		}
+		if (running == 0)
+			break;
+
+		pid = wait(&status);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "wait failed: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (i = 0; i < next; i++)
+			if (jobs[i].started && jobs[i].pid == pid)
+				break;
+		if (i == next)
+			continue;
+
+		jobs[i].done = true;
+		jobs[i].status = status;
+		jobs[i].secs = (now.tv_sec - jobs[i].start.tv_sec) +
+			       (now.tv_nsec - jobs[i].start.tv_nsec) / 1e9;
+		running--;
+		if (!format_ok(&jobs[i]))
+			failed = true;
+
+		while (emitted < next && jobs[emitted].done)
+			format_emit(&jobs[emitted++]);
+	}
+
+	/* A job that failed to start left its buffers behind */
+	for (i = emitted; i < nr; i++) {
+		if (jobs[i].out)
+			fclose(jobs[i].out);
+		if (jobs[i].err)
+			fclose(jobs[i].err);
+	}
+
+	format_summary(jobs, nr);
+	return failed;
+}
+
+/*
+ * Several cache devices can be formatted into one set, as the superblock
+ * has always allowed, but the kernel only runs sets of a single cache
+ * device since Linux 5.10.
+ */
+static void multi_cache_warning(void)
+{
+	fprintf(stderr,
+		"WARNING: Linux 5.10 and later only register cache sets with a single cache device\n\n");
+}
+
+/*
+ * Devices are formatted under their resolved name, the way bad_dev()
+ * resolves them for the other bcache subcommands: block devices have to
+ * be /dev/<kernel name>, which is also all lib.c has room for. Image
+ * files are taken wherever they are.
+ * returns NULL and the resolved name in *real, or why @dev can't be used
+ */
+static const char *resolve_dev(const char *dev, char **real)
+{
+	const char *why = NULL, *kname;
+	struct stat st;
+	size_t len;
+
+	*real = realpath(dev, NULL);
+	if (*real == NULL)
+		return strerror(errno);
+
+	if (stat(*real, &st)) {
+		why = strerror(errno);
+	} else if (S_ISBLK(st.st_mode)) {
+		kname = *real + DEV_PREFIX_LEN;
+		len = strncmp(*real, "/dev/", DEV_PREFIX_LEN) ? 0 : strlen(kname);
+		if (len == 0 || len > DEV_KNAME_MAX ||
+		    strspn(kname, "abcdefghijklmnopqrstuvwxyz"
+				  "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-") != len)
+			why = "wrong device name";
+	} else if (!S_ISREG(st.st_mode)) {
+		why = "not a block device";
+	}
+
+	if (why) {
+		free(*real);
+		*real = NULL;
+	}
+	return why;
+}
+
+const char * const cache_modes[] = {
+	"writethrough",
+	"writeback",
+	"writearound",
+	"none",
+	NULL
+};
+
+/*
+ * bcache make --manifest <file> formats a whole node in one run:
+ *
+ *	cset [uuid=<uuid>] [block=<size>] [bucket=<size>] [discard]
+ *	     [replacement=lru|fifo|random] [cachemode=<mode>]
+ *	cache <device> [bucket=<size>] [label=<label>]
+ *	backing <device> [cachemode=<mode>] [label=<label>] [offset=<sectors>]
+ *
+ * Devices belong to the cset line above them and take its options unless
+ * they set their own; backing devices above the first cset line belong to
+ * no cache set. A cset takes up to MAX_CACHES_PER_SET cache devices.
+ * Sizes accept human readable units, '#' starts a comment.
+ * The whole manifest is checked before any device is touched, then every
+ * device is formatted at once (or -j at a time).
+ */
+struct manifest_set {
+	struct sb_context	sbc;
+	unsigned int		ncache;
+};
+
+struct manifest {
+	const char		*path;
+	struct format_job	*jobs;
+	unsigned int		*lines;
+	unsigned int		*set_of;
+	unsigned int		nr;
+	struct manifest_set	*sets;
+	unsigned int		nr_sets;
+	unsigned int		errors;
+};
+
+static void manifest_error(struct manifest *m, unsigned int line,
+			   const char *fmt, ...)
+{
+	va_list args;
+
+	fprintf(stderr, "%s:%u: ", m->path, line);
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fputc('\n', stderr);
+	m->errors++;
+}
+
+/* Like hatoi_validate(), but reports against the manifest line */
+static int manifest_size(struct manifest *m, unsigned int line,
+			 const char *value, const char *what,
+			 unsigned long max, unsigned int *sectors)
+{
+	uint64_t v = hatoi(value);
+
+	if (!v || (v & (v - 1))) {
+		manifest_error(m, line, "%s must be a power of two", what);
+		return 1;
+	}
+	if (v / 512 == 0 || v / 512 > max) {
+		manifest_error(m, line, "%s %s out of range", what, value);
+		return 1;
+	}
+	*sectors = v / 512;
+	return 0;
+}
+
+static int manifest_option(struct manifest *m, unsigned int line,
+			   char *opt, struct sb_context *sbc, const char *kind)
+{
+	char *value = strchr(opt, '=');
+	ssize_t i;
+
+	if (value)
+		*value++ = '\0';
+
+	if (!strcmp(kind, "cset") && !strcmp(opt, "discard") && !value) {
+		sbc->discard = true;
+	} else if (value == NULL) {
+		manifest_error(m, line, "%s takes no option %s", kind, opt);
+		return 1;
+	} else if (!strcmp(kind, "cset") && !strcmp(opt, "uuid")) {
+		if (uuid_parse(value, sbc->set_uuid)) {
+			manifest_error(m, line, "bad uuid %s", value);
+			return 1;
+		}
+	} else if (!strcmp(kind, "cset") && !strcmp(opt, "block")) {
+		if (manifest_size(m, line, value, "block size", USHRT_MAX,
+				  &sbc->block_size))
+			return 1;
+	} else if (strcmp(kind, "backing") && !strcmp(opt, "bucket")) {
+		if (manifest_size(m, line, value, "bucket size", UINT_MAX,
+				  &sbc->bucket_size))
+			return 1;
+	} else if (!strcmp(kind, "cset") && !strcmp(opt, "replacement")) {
+		i = read_string_list(value, cache_replacement_policies);
+		if (i < 0) {
+			manifest_error(m, line, "unknown replacement policy %s",
+				       value);
+			return 1;
+		}
+		sbc->cache_replacement_policy = i;
+	} else if (strcmp(kind, "cache") && !strcmp(opt, "cachemode")) {
+		i = read_string_list(value, cache_modes);
+		if (i < 0) {
+			manifest_error(m, line, "unknown cache mode %s", value);
+			return 1;
+		}
+		sbc->cache_mode = i;
+	} else if (strcmp(kind, "cset") && !strcmp(opt, "label")) {
+		if (strlen(value) >= SB_LABEL_SIZE) {
+			manifest_error(m, line, "label is too long");
+			return 1;
+		}
+		sbc->label = strdup(value);
+	} else if (!strcmp(kind, "backing") && !strcmp(opt, "offset")) {
+		sbc->data_offset = strtoull(value, NULL, 10);
+		if (sbc->data_offset < BDEV_DATA_START_DEFAULT) {
+			manifest_error(m, line,
+				       "bad data offset; minimum %d sectors",
+				       BDEV_DATA_START_DEFAULT);
+			return 1;
+		}
+	} else {
+		manifest_error(m, line, "%s takes no option %s", kind, opt);
+		return 1;
+	}
+	return 0;
+}
+
+static int manifest_add_set(struct manifest *m, struct sb_context *defaults)
+{
+	struct manifest_set *n;
+
+	n = realloc(m->sets, (m->nr_sets + 1) * sizeof(*n));
+	if (n == NULL)
+		return 1;
+	m->sets = n;
+	memset(&n[m->nr_sets], 0, sizeof(*n));
+	n[m->nr_sets].sbc = *defaults;
+	uuid_generate(n[m->nr_sets].sbc.set_uuid);
+	m->nr_sets++;
+	return 0;
+}
+
+static int manifest_add_dev(struct manifest *m, unsigned int line,
+			    char *dev, bool bdev)
+{
+	struct format_job *jobs;
+	unsigned int *lines, *set_of;
+
+	jobs = realloc(m->jobs, (m->nr + 1) * sizeof(*jobs));
+	if (jobs)
+		m->jobs = jobs;
+	lines = realloc(m->lines, (m->nr + 1) * sizeof(*lines));
+	if (lines)
+		m->lines = lines;
+	set_of = realloc(m->set_of, (m->nr + 1) * sizeof(*set_of));
+	if (set_of)
+		m->set_of = set_of;
+	if (!jobs || !lines || !set_of)
+		return 1;
+
+	memset(&jobs[m->nr], 0, sizeof(*jobs));
+	jobs[m->nr].dev = strdup(dev);
+	jobs[m->nr].bdev = bdev;
+	jobs[m->nr].sbc = m->sets[m->nr_sets - 1].sbc;
+	/* zero until the set's bucket size is settled, or bucket= is seen */
+	jobs[m->nr].sbc.bucket_size = 0;
+	lines[m->nr] = line;
+	set_of[m->nr] = m->nr_sets - 1;
+	m->nr++;
+	return jobs[m->nr - 1].dev == NULL;
+}
+
+static void manifest_parse(struct manifest *m, FILE *f,
+			   struct sb_context *defaults)
+{
+	char buf[1024], *tok, *save, *dev;
+	unsigned int line = 0;
+	bool bdev;
+
+	/* Set 0 holds the backing devices above the first cset line */
+	if (manifest_add_set(m, defaults))
+		goto nomem;
+
+	while (fgets(buf, sizeof(buf), f)) {
+		line++;
+		buf[strcspn(buf, "#\n")] = '\0';
+		tok = strtok_r(buf, " \t", &save);
+		if (tok == NULL)
+			continue;
+
+		if (!strcmp(tok, "cset")) {
+			if (manifest_add_set(m, defaults))
+				goto nomem;
+			while ((tok = strtok_r(NULL, " \t", &save)))
+				manifest_option(m, line, tok,
+						&m->sets[m->nr_sets - 1].sbc,
+						"cset");
+			continue;
+		}
+
+		if (!strcmp(tok, "cache")) {
+			bdev = false;
+		} else if (!strcmp(tok, "backing")) {
+			bdev = true;
+		} else {
+			manifest_error(m, line, "unknown keyword %s", tok);
+			continue;
+		}
+
+		dev = strtok_r(NULL, " \t", &save);
+		if (dev == NULL) {
+			manifest_error(m, line, "%s needs a device", tok);
+			continue;
+		}
+		if (!bdev && m->nr_sets == 1) {
+			manifest_error(m, line,
+				       "cache device %s outside of a cset", dev);
+			continue;
+		}
+		if (!bdev &&
+		    m->sets[m->nr_sets - 1].ncache == MAX_CACHES_PER_SET) {
+			manifest_error(m, line,
+				       "a cset holds at most %d cache devices",
+				       MAX_CACHES_PER_SET);
+			continue;
+		}
+		if (manifest_add_dev(m, line, dev, bdev))
+			goto nomem;
+		if (!bdev)
+			m->jobs[m->nr - 1].sbc.nr_this_dev =
+				m->sets[m->nr_sets - 1].ncache++;
+		while ((tok = strtok_r(NULL, " \t", &save)))
+			manifest_option(m, line, tok, &m->jobs[m->nr - 1].sbc,
+					bdev ? "backing" : "cache");
+	}
+	return;
+nomem:
+	fprintf(stderr, "Error: fail to allocate memory buffer\n");
+	exit(EXIT_FAILURE);
+}
+
+/* Checks every device against the whole plan, and settles the sizes */
+/*
+ * What write_sb() and the backing device checks would refuse, found before
+ * anything is formatted so one bad line doesn't leave the other sets done.
+ * A busy device is only fine with --force, which stops it first, and then
+ * only if it is a bcache device.
+ */
+static void manifest_check_dev(struct manifest *m, unsigned int i, bool force)
+{
+	struct format_job *job = &m->jobs[i];
+	struct cache_sb_disk sb_disk;
+	bool busy = false, is_bcache;
+	int fd;
+
+	fd = open(job->dev, O_RDONLY|O_EXCL);
+	if (fd < 0 && errno == EBUSY) {
+		busy = true;
+		fd = open(job->dev, O_RDONLY);
+	}
+	if (fd < 0) {
+		manifest_error(m, m->lines[i], "can't open %s: %s",
+			       job->dev, strerror(errno));
+		return;
+	}
+
+	if (pread(fd, &sb_disk, sizeof(sb_disk), SB_START) != sizeof(sb_disk)) {
+		manifest_error(m, m->lines[i], "can't read the superblock of %s",
+			       job->dev);
+		close(fd);
+		return;
+	}
+	is_bcache = !memcmp(sb_disk.magic, bcache_magic, 16);
+
+	if (busy && !force)
+		manifest_error(m, m->lines[i], "%s is busy", job->dev);
+	else if (busy && !is_bcache)
+		manifest_error(m, m->lines[i],
+			       "%s is busy, and not a bcache device", job->dev);
+	else if (is_bcache && !job->sbc.wipe_bcache && !force)
+		manifest_error(m, m->lines[i],
+			       "already a bcache device on %s, overwrite with --wipe-bcache or --force",
+			       job->dev);
+	else if (!is_bcache && probe_other_sb(fd) == 1)
+		manifest_error(m, m->lines[i],
+			       "%s already has a non-bcache superblock, remove it using wipefs",
+			       job->dev);
+	close(fd);
+
+	if (job->bdev && set_data_offset(job))
+		manifest_error(m, m->lines[i],
+			       "%s can't be used as a backing device", job->dev);
+}
+
+static void manifest_check(struct manifest *m, bool auto_geometry, bool force)
+{
+	unsigned int i, j, s, nc, nb;
+	char **real, **caches, **backings;
+	const char *why;
+
+	real = calloc(m->nr, sizeof(*real));
+	caches = calloc(m->nr, sizeof(*caches));
+	backings = calloc(m->nr, sizeof(*backings));
+	if (!real || !caches || !backings) {
+		manifest_error(m, 0, "fail to allocate memory buffer");
+		goto out;
+	}
+
+	for (i = 0; i < m->nr; i++) {
+		why = resolve_dev(m->jobs[i].dev, &real[i]);
+		if (why) {
+			manifest_error(m, m->lines[i], "%s: %s",
+				       m->jobs[i].dev, why);
+			continue;
+		}
+		for (j = 0; j < i; j++)
+			if (real[j] && !strcmp(real[i], real[j]))
+				manifest_error(m, m->lines[i],
+					       "%s is already listed on line %u",
+					       m->jobs[i].dev, m->lines[j]);
+		/* formatted under the resolved name, like on the command line */
+		free(m->jobs[i].dev);
+		m->jobs[i].dev = real[i];
+		manifest_check_dev(m, i, force);
+	}
+	if (m->errors)
+		goto out;
+
+	/* Devices of one set share its block size, like a single run */
+	for (s = 0; s < m->nr_sets; s++) {
+		unsigned int block = m->sets[s].sbc.block_size;
+		unsigned int bucket = m->sets[s].sbc.bucket_size;
+		unsigned int set_bucket = 0;
+
+		nc = nb = 0;
+		for (i = 0; i < m->nr; i++) {
+			if (m->set_of[i] != s)
+				continue;
+			if (m->jobs[i].bdev)
+				backings[nb++] = m->jobs[i].dev;
+			else
+				caches[nc++] = m->jobs[i].dev;
+		}
+		if (!nc && !nb)
+			continue;
+
+		if (auto_geometry) {
+			choose_geometry(caches, nc, backings, nb,
+					&block, &bucket);
+		} else if (!block) {
+			for (i = 0; i < nc; i++)
+				block = max(block, get_blocksize(caches[i]));
+			for (i = 0; i < nb; i++)
+				block = max(block, get_blocksize(backings[i]));
+		}
+		if (!bucket)
+			bucket = 1024;
+
+		for (i = 0; i < m->nr; i++) {
+			struct format_job *job = &m->jobs[i];
+			uint64_t sectors;
+			int fd;
+
+			if (m->set_of[i] != s)
+				continue;
+			job->sbc.block_size = block;
+			/* Zoned cache devices take the zone size */
+			if (!job->bdev) {
+				if (!job->sbc.bucket_size)
+					job->sbc.bucket_size =
+						m->sets[s].sbc.bucket_size;
+				if (check_bucket_size_for_zoned_device(job->dev,
+						&job->sbc.bucket_size))
+					manifest_error(m, m->lines[i],
+						       "%s can't be used as a cache device",
+						       job->dev);
+			}
+			if (!job->sbc.bucket_size)
+				job->sbc.bucket_size = bucket;
+			if (job->bdev)
+				continue;
+
+			/* Members of a set have to agree on the bucket size */
+			job->sbc.nr_in_set = m->sets[s].ncache;
+			if (!set_bucket)
+				set_bucket = job->sbc.bucket_size;
+			else if (job->sbc.bucket_size != set_bucket)
+				manifest_error(m, m->lines[i],
+					       "bucket size of %s differs from the rest of its cset",
+					       job->dev);
+
+			if (job->sbc.bucket_size < block)
+				manifest_error(m, m->lines[i],
+					       "bucket size of %s is smaller than the block size",
+					       job->dev);
+			fd = open(job->dev, O_RDONLY);
+			if (fd < 0) {
+				manifest_error(m, m->lines[i], "can't open %s: %s",
+					       job->dev, strerror(errno));
+				continue;
+			}
+			sectors = getblocks(fd);
+			close(fd);
+			if (sectors / job->sbc.bucket_size < 1 << 7)
+				manifest_error(m, m->lines[i],
+					       "%s is too small for %u sector buckets",
+					       job->dev, job->sbc.bucket_size);
+		}
+	}
+out:
+	free(real);
+	free(caches);
+	free(backings);
+}
+
+static int make_from_manifest(const char *path, struct sb_context *defaults,
+			      bool auto_geometry, long max_jobs, bool force,
+			      bool use_ioctl)
+{
+	struct manifest m;
+	unsigned int i, ncache = 0;
+	FILE *f;
+	int ret;
+
+	memset(&m, 0, sizeof(m));
+	m.path = path;
+	f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	manifest_parse(&m, f, defaults);
+	fclose(f);
+	if (!m.errors && !m.nr) {
+		fprintf(stderr, "%s: no devices\n", path);
+		return 1;
+	}
+	manifest_check(&m, auto_geometry, force);
+	if (m.errors) {
+		fprintf(stderr, "%u error(s) in %s, nothing formatted\n",
+			m.errors, path);
+		return 1;
+	}
+
+	for (i = 0; i < m.nr; i++)
+		ncache += !m.jobs[i].bdev;
+	for (i = 0; i < m.nr_sets; i++)
+		if (m.sets[i].ncache > 1) {
+			multi_cache_warning();
+			break;
+		}
+	printf("Formatting %u cache and %u backing devices in %u cache sets\n\n",
+	       ncache, m.nr - ncache, m.nr_sets - 1);
+
+	ret = format_devices(m.jobs, m.nr, max_jobs ? max_jobs : m.nr,
+			     force, use_ioctl);
+	return ret ? 1 : 0;
+}
+
 int make_bcache(int argc, char **argv)
 {
 	int c, bdev = -1;
@@ -604,12 +1334,21 @@ int make_bcache(int argc, char **argv)
 	char *cache_devices[argc];
 	char *backing_devices[argc];
 	char label[SB_LABEL_SIZE] = { 0 };
-	unsigned int block_size = 0, bucket_size = 1024;
+	unsigned int block_size = 0, bucket_size = 0;
 	int writeback = 0, discard = 0, wipe_bcache = 0, force = 0, use_ioctl = 0;
+	int auto_geometry = 0;
 	unsigned int cache_replacement_policy = 0;
 	uint64_t data_offset = BDEV_DATA_START_DEFAULT;
 	uuid_t set_uuid;
 	struct sb_context sbc;
+	struct format_job *jobs;
+	long max_jobs = 0;
+	char *manifest = NULL;
+	struct discard_opts discard_opts = {
+		.mode		= DISCARD_AUTO,
+		.threads	= DISCARD_THREADS_DEFAULT,
+	};
+	ssize_t mode;
 
 	uuid_generate(set_uuid);
 
@@ -630,11 +1369,17 @@ int make_bcache(int argc, char **argv)
 		{ "force",		0, &force,	 1 },
 		{ "label",		1, NULL,	 'l' },
 		{ "ioctl",		0, &use_ioctl,	1},
+		{ "auto-geometry",	0, &auto_geometry,	1 },
+		{ "manifest",		1, NULL,	'F' },
+		{ "jobs",		1, NULL,	'j' },
+		{ "discard-mode",	1, NULL,	'M' },
+		{ "discard-rate",	1, NULL,	'R' },
+		{ "discard-jobs",	1, NULL,	'J' },
 		{ NULL,			0, NULL,	0 },
 	};
 
 	while ((c = getopt_long(argc, argv,
-				"-hCBUo:w:b:l:",
+				"-hCBUo:w:b:l:j:",
 				opts, NULL)) != -1)
 		switch (c) {
 		case 'C':
@@ -685,6 +1430,36 @@ int make_bcache(int argc, char **argv)
 			}
 			strcpy(label, optarg);
 			break;
+		case 'j':
+			max_jobs = atol(optarg);
+			if (max_jobs < 1) {
+				fprintf(stderr, "Bad number of jobs %s\n",
+					optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'F':
+			manifest = optarg;
+			break;
+		case 'M':
+			mode = read_string_list(optarg, discard_modes);
+			if (mode < 0) {
+				fprintf(stderr, "Bad discard mode %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			discard_opts.mode = mode;
+			break;
+		case 'R':
+			discard_opts.rate = hatoi(optarg);
+			break;
+		case 'J':
+			if (atoi(optarg) < 1) {
+				fprintf(stderr, "Bad number of discard jobs %s\n",
+					optarg);
+				exit(EXIT_FAILURE);
+			}
+			discard_opts.threads = atoi(optarg);
+			break;
 		case 'h':
 			usage();
 			break;
@@ -701,15 +1476,71 @@ int make_bcache(int argc, char **argv)
 			break;
 		}
 
+	sbc.block_size = block_size;
+	sbc.bucket_size = bucket_size;
+	sbc.cache_mode = writeback ?
+		CACHE_MODE_WRITEBACK : CACHE_MODE_WRITETHROUGH;
+	sbc.discard = discard;
+	sbc.discard_opts = discard_opts;
+	sbc.wipe_bcache = wipe_bcache;
+	sbc.cache_replacement_policy = cache_replacement_policy;
+	sbc.data_offset = data_offset;
+	memcpy(sbc.set_uuid, set_uuid, sizeof(sbc.set_uuid));
+	sbc.label = label;
+	sbc.nr_in_set = 1;
+	sbc.nr_this_dev = 0;
+
+	if (manifest) {
+		if (ncache_devices || nbacking_devices) {
+			fprintf(stderr,
+				"Devices go in the manifest, not on the command line\n");
+			exit(EXIT_FAILURE);
+		}
+		/* the options given apply to every set in the manifest */
+		if (make_from_manifest(manifest, &sbc, auto_geometry,
+				       max_jobs, force, use_ioctl))
+			exit(EXIT_FAILURE);
+		return 0;
+	}
+
 	if (!ncache_devices && !nbacking_devices) {
 		fprintf(stderr, "Please supply a device\n");
 		usage();
 	}
 
-	if (ncache_devices > 1) {
-		fprintf(stderr, "Please specify only one cache device\n");
+	if (ncache_devices > MAX_CACHES_PER_SET) {
+		fprintf(stderr, "Please specify at most %d cache devices\n",
+			MAX_CACHES_PER_SET);
 		usage();
 	}
+	if (ncache_devices > 1)
+		multi_cache_warning();
+
+	for (i = 0; i < ncache_devices + nbacking_devices; i++) {
+		char **dev = i < ncache_devices ? &cache_devices[i] :
+				&backing_devices[i - ncache_devices];
+		char *real;
+		const char *why = resolve_dev(*dev, &real);
+
+		if (why) {
+			fprintf(stderr, "%s: %s\n", *dev, why);
+			exit(EXIT_FAILURE);
+		}
+		*dev = real;
+	}
+
+	/* Zoned cache devices pick the bucket size, the zone size */
+	for (i = 0; i < ncache_devices; i++)
+		if (check_bucket_size_for_zoned_device(cache_devices[i],
+						       &bucket_size))
+			exit(EXIT_FAILURE);
+
+	if (auto_geometry)
+		choose_geometry(cache_devices, ncache_devices,
+				backing_devices, nbacking_devices,
+				&block_size, &bucket_size);
+	if (!bucket_size)
+		bucket_size = 1024;
 
 	if (bucket_size < block_size) {
 		fprintf(stderr,
@@ -729,30 +1560,184 @@ int make_bcache(int argc, char **argv)
 
 	sbc.block_size = block_size;
 	sbc.bucket_size = bucket_size;
-	sbc.writeback = writeback;
-	sbc.discard = discard;
-	sbc.wipe_bcache = wipe_bcache;
-	sbc.cache_replacement_policy = cache_replacement_policy;
-	sbc.data_offset = data_offset;
-	memcpy(sbc.set_uuid, set_uuid, sizeof(sbc.set_uuid));
-	sbc.label = label;
 
+	jobs = calloc(ncache_devices + nbacking_devices, sizeof(*jobs));
+	if (jobs == NULL) {
+		fprintf(stderr, "Error: fail to allocate memory buffer\n");
+		exit(EXIT_FAILURE);
+	}
+	/* The cache devices are one set, numbered in command line order */
 	for (i = 0; i < ncache_devices; i++) {
-		if (use_ioctl) {
-			fprintf(stderr, "WARNING. Cache devices should use the normal way!\n");
-		}
-		write_sb(cache_devices[i], &sbc, false, force);
+		jobs[i].dev = cache_devices[i];
+		jobs[i].sbc = sbc;
+		jobs[i].sbc.nr_in_set = ncache_devices;
+		jobs[i].sbc.nr_this_dev = i;
 	}
-
 	for (i = 0; i < nbacking_devices; i++) {
-		check_data_offset_for_zoned_device(backing_devices[i],
-						   &sbc.data_offset);
-		if (use_ioctl) {
-			write_sb_ioctl(backing_devices[i], &sbc, true, force);
-		} else {
-			write_sb(backing_devices[i], &sbc, true, force);
-		}
+		jobs[ncache_devices + i].dev = backing_devices[i];
+		jobs[ncache_devices + i].bdev = true;
+		jobs[ncache_devices + i].sbc = sbc;
+		if (set_data_offset(&jobs[ncache_devices + i]))
+			exit(EXIT_FAILURE);
 	}
 
+	/* A single device is formatted in place, as it always was */
+	if (ncache_devices + nbacking_devices == 1) {
+		format_one(&jobs[0], force, use_ioctl);
+		free(jobs);
+		return 0;
+	}
+
+	if (!max_jobs)
+		max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (max_jobs < 1)
+		max_jobs = 1;
+	if (format_devices(jobs, ncache_devices + nbacking_devices,
+			   max_jobs, force, use_ioctl))
+		exit(EXIT_FAILURE);
+	free(jobs);
 	return 0;
 }
+
+/*
+ * The kernel keeps bucket priorities and generations in a chain of
+ * prio_buckets() buckets, each holding a struct prio_set header (40
+ * bytes) followed by 3 byte struct bucket_disk entries.
+ */
+#define PRIO_SET_BYTES		40
+#define BUCKET_DISK_BYTES	3
+
+static uint64_t prio_buckets(struct cache_sb *sb, uint64_t nbuckets)
+{
+	uint64_t per_bucket = ((uint64_t) sb->bucket_size * 512 -
+			       PRIO_SET_BYTES) / BUCKET_DISK_BYTES;
+
+	return (nbuckets + per_bucket - 1) / per_bucket;
+}
+
+static int resize_backing(char *dev, struct cache_sb *sb, uint64_t sectors)
+{
+	uint64_t data_offset = BDEV_DATA_START_DEFAULT;
+
+	if (sb->version == BCACHE_SB_VERSION_BDEV_WITH_OFFSET ||
+	    sb->version == BCACHE_SB_VERSION_BDEV_WITH_FEATURES)
+		data_offset = sb->data_offset;
+
+	if (data_offset < BDEV_DATA_START_DEFAULT) {
+		fprintf(stderr, "%s: data_offset %ju overlaps the superblock\n",
+			dev, data_offset);
+		return 1;
+	}
+	if (data_offset % sb->block_size) {
+		fprintf(stderr,
+			"%s: data_offset %ju is not a multiple of the block size (%u sectors)\n",
+			dev, data_offset, sb->block_size);
+		return 1;
+	}
+	if (data_offset >= sectors) {
+		fprintf(stderr,
+			"%s: data_offset %ju is beyond the end of the device (%ju sectors)\n",
+			dev, data_offset, sectors);
+		return 1;
+	}
+
+	/* The backing superblock has no size, the kernel reads it at registration */
+	printf("%s: %ju sectors of data from sector %ju, nothing to rewrite\n",
+	       dev, sectors - data_offset, data_offset);
+	return 0;
+}
+
+static int resize_cache(char *dev, int fd, struct cache_sb_disk *sb_disk,
+			struct cache_sb *sb, uint64_t sectors)
+{
+	uint64_t nbuckets = sectors / sb->bucket_size;
+
+	if (nbuckets == sb->nbuckets) {
+		printf("%s: already %ju buckets, nothing to do\n",
+		       dev, nbuckets);
+		return 0;
+	}
+	/* Cached data, the btree or the journal may live past the new end */
+	if (nbuckets < sb->nbuckets) {
+		fprintf(stderr,
+			"%s: shrinking from %ju to %ju buckets would lose cached data, refusing\n",
+			dev, (uintmax_t) sb->nbuckets, nbuckets);
+		return 1;
+	}
+	/*
+	 * A cache set in use has its prio chain written for the old number
+	 * of buckets, which the kernel reads back nbuckets entries at a time.
+	 * Growing within the last prio bucket is fine, the new buckets just
+	 * pick up whatever that bucket holds past the old end.
+	 */
+	if (CACHE_SYNC(sb) &&
+	    prio_buckets(sb, nbuckets) != prio_buckets(sb, sb->nbuckets)) {
+		fprintf(stderr,
+			"%s: growing to %ju buckets needs %ju instead of %ju prio buckets,\n"
+			"which an existing cache set can't be changed to; "
+			"re-create it with make instead\n",
+			dev, nbuckets, prio_buckets(sb, nbuckets),
+			prio_buckets(sb, sb->nbuckets));
+		return 1;
+	}
+
+	printf("%s: nbuckets %ju -> %ju\n", dev, (uintmax_t) sb->nbuckets,
+	       nbuckets);
+	sb->nbuckets = nbuckets;
+
+	to_cache_sb_disk(sb_disk, sb);
+	sb_disk->csum = cpu_to_le64(csum_set(sb_disk));
+	if (pwrite(fd, sb_disk, sizeof(*sb_disk), SB_START) !=
+	    sizeof(*sb_disk)) {
+		fprintf(stderr, "Failed to write super block for %s: %m\n",
+			dev);
+		return 1;
+	}
+	fsync(fd);
+	sbcache_invalidate();
+	return 0;
+}
+
+/*
+ * Catch a cache or backing device's superblock up with a device that has
+ * grown, keeping what is on it. Registered devices are refused, the
+ * kernel would overwrite the superblock with its own copy.
+ */
+int resize_bcache(char *dev)
+{
+	struct cache_sb_disk sb_disk;
+	struct cache_sb sb;
+	struct bdev bd;
+	struct cdev cd;
+	int fd, type = 1, ret;
+
+	/* magic, checksum and features */
+	if (detail_dev(dev, &bd, &cd, &type))
+		return 1;
+
+	fd = open(dev, O_RDWR|O_EXCL);
+	if (fd < 0) {
+		if (errno == EBUSY)
+			fprintf(stderr,
+				"%s is in use, unregister it before resizing\n",
+				dev);
+		else
+			fprintf(stderr, "Can't open dev %s: %m\n", dev);
+		return 1;
+	}
+
+	if (pread(fd, &sb_disk, sizeof(sb_disk), SB_START) !=
+	    sizeof(sb_disk)) {
+		fprintf(stderr, "Couldn't read super block of %s\n", dev);
+		close(fd);
+		return 1;
+	}
+	to_cache_sb(&sb, &sb_disk);
+
+	if (SB_IS_BDEV(&sb))
+		ret = resize_backing(dev, &sb, getblocks(fd));
+	else
+		ret = resize_cache(dev, fd, &sb_disk, &sb, getblocks(fd));
+	close(fd);
+	return ret;
+}
@@ -1,2 +1,3 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 extern int make_bcache(int argc, char **argv);
+extern int resize_bcache(char *dev);
@@ -0,0 +1,219 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Persistent cache of the superblocks found while listing devices.
+ *
+ * Reading the superblock of every block device on every `bcache show`
+ * is slow on hosts with many disks and wakes up disks that are spun
+ * down. The outcome of each probe (the raw superblock, or the fact that
+ * there is none) is kept in a small file on /run, keyed by dev_t, the
+ * disk sequence number, the partition start and the size. The kernel
+ * bumps diskseq whenever the media behind a device changes, so an entry
+ * with matching key can be used instead of reading the device again.
+ *
+ * The file is host local and lives on tmpfs, so it is stored in host
+ * byte order and is gone after a reboot. Anything that goes wrong with
+ * it just means the devices are read again.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sbcache.h"
+
+#define SBCACHE_MAGIC		"bcsbcach"
+#define SBCACHE_VERSION		1
+
+struct sbcache_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	sb_size;	/* sizeof(struct cache_sb_disk) */
+	uint32_t	nr;
+	uint32_t	pad;
+};
+
+/* Followed by a struct cache_sb_disk when has_sb is set */
+struct sbcache_record {
+	struct sbcache_key	key;
+	uint32_t		has_sb;
+	uint32_t		pad;
+};
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = read(fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static struct sbcache_entry *sbcache_new_entry(struct sbcache *cache)
+{
+	struct sbcache_entry *e;
+
+	if (cache->nr == cache->alloc) {
+		unsigned int alloc = cache->alloc ? cache->alloc * 2 : 64;
+
+		e = realloc(cache->entries, alloc * sizeof(*e));
+		if (e == NULL)
+			return NULL;
+		cache->entries = e;
+		cache->alloc = alloc;
+	}
+	return &cache->entries[cache->nr++];
+}
+
+/*
+ * Fill @cache from SBCACHE_PATH. A missing, foreign or damaged file
+ * leaves it empty (or partially filled), which only costs a rescan.
+ */
+void sbcache_load(struct sbcache *cache)
+{
+	struct sbcache_header hdr;
+	struct sbcache_record rec;
+	struct sbcache_entry *e;
+	struct stat st;
+	unsigned int i;
+	int fd;
+
+	memset(cache, 0, sizeof(*cache));
+
+	fd = open(SBCACHE_PATH, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	/* Only trust a file written by root or by ourselves */
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+	    (st.st_uid != 0 && st.st_uid != geteuid()))
+		goto out;
+
+	if (read_full(fd, &hdr, sizeof(hdr)) ||
+	    memcmp(hdr.magic, SBCACHE_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != SBCACHE_VERSION ||
+	    hdr.sb_size != sizeof(struct cache_sb_disk) ||
+	    hdr.nr > st.st_size / sizeof(rec))
+		goto out;
+
+	for (i = 0; i < hdr.nr; i++) {
+		if (read_full(fd, &rec, sizeof(rec)))
+			break;
+		e = sbcache_new_entry(cache);
+		if (e == NULL)
+			break;
+		e->key = rec.key;
+		e->has_sb = rec.has_sb;
+		if (e->has_sb && read_full(fd, &e->sb, sizeof(e->sb))) {
+			cache->nr--;
+			break;
+		}
+	}
+out:
+	close(fd);
+}
+
+/*
+ * Devices come back in /sys/block order, which is the order they were
+ * saved in, so the search starts where the previous one succeeded.
+ */
+struct sbcache_entry *sbcache_lookup(struct sbcache *cache,
+				     const struct sbcache_key *key)
+{
+	struct sbcache_entry *e;
+	unsigned int i, idx;
+
+	for (i = 0; i < cache->nr; i++) {
+		idx = (cache->hint + i) % cache->nr;
+		e = &cache->entries[idx];
+		if (!memcmp(&e->key, key, sizeof(*key))) {
+			cache->hint = idx + 1;
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/* @sb is NULL when the device has no bcache superblock */
+int sbcache_add(struct sbcache *cache, const struct sbcache_key *key,
+		const struct cache_sb_disk *sb)
+{
+	struct sbcache_entry *e;
+
+	e = sbcache_new_entry(cache);
+	if (e == NULL)
+		return 1;
+	e->key = *key;
+	e->has_sb = sb != NULL;
+	if (sb)
+		e->sb = *sb;
+	return 0;
+}
+
+/* Replace SBCACHE_PATH with @cache atomically, failures are ignored */
+void sbcache_save(struct sbcache *cache)
+{
+	char tmp[] = SBCACHE_PATH ".XXXXXX";
+	struct sbcache_header hdr;
+	struct sbcache_record rec;
+	struct sbcache_entry *e;
+	unsigned int i;
+	FILE *f;
+	int fd, err;
+
+	if (mkdir(SBCACHE_DIR, 0755) && errno != EEXIST)
+		return;
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return;
+	f = fdopen(fd, "w");
+	if (f == NULL) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SBCACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version = SBCACHE_VERSION;
+	hdr.sb_size = sizeof(struct cache_sb_disk);
+	hdr.nr = cache->nr;
+	fwrite(&hdr, sizeof(hdr), 1, f);
+
+	for (i = 0; i < cache->nr; i++) {
+		e = &cache->entries[i];
+		memset(&rec, 0, sizeof(rec));
+		rec.key = e->key;
+		rec.has_sb = e->has_sb;
+		fwrite(&rec, sizeof(rec), 1, f);
+		if (e->has_sb)
+			fwrite(&e->sb, sizeof(e->sb), 1, f);
+	}
+
+	err = ferror(f);
+	if (fclose(f) || err || rename(tmp, SBCACHE_PATH))
+		unlink(tmp);
+}
+
+void sbcache_free(struct sbcache *cache)
+{
+	free(cache->entries);
+	memset(cache, 0, sizeof(*cache));
+}
+
+/* Called by everything that writes a superblock or changes registration */
+void sbcache_invalidate(void)
+{
+	unlink(SBCACHE_PATH);
+}
@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#ifndef _BCACHE_SBCACHE_H
+#define _BCACHE_SBCACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bcache.h"
+
+#define SBCACHE_DIR	"/run/bcache"
+#define SBCACHE_PATH	SBCACHE_DIR "/sbcache"
+
+/* What has to match for a cached superblock to be trusted */
+struct sbcache_key {
+	uint64_t	devt;
+	uint64_t	diskseq;
+	uint64_t	start;
+	uint64_t	size;
+};
+
+struct sbcache_entry {
+	struct sbcache_key	key;
+	bool			has_sb;	/* false: no bcache superblock */
+	struct cache_sb_disk	sb;
+};
+
+struct sbcache {
+	struct sbcache_entry	*entries;
+	unsigned int		nr;
+	unsigned int		alloc;
+	unsigned int		hint;
+};
+
+void sbcache_load(struct sbcache *cache);
+struct sbcache_entry *sbcache_lookup(struct sbcache *cache,
+				     const struct sbcache_key *key);
+int sbcache_add(struct sbcache *cache, const struct sbcache_key *key,
+		const struct cache_sb_disk *sb);
+void sbcache_save(struct sbcache *cache);
+void sbcache_free(struct sbcache *cache);
+void sbcache_invalidate(void);
+
+#endif
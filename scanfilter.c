@@ -0,0 +1,178 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Decide which block devices are worth opening when listing.
+ *
+ * Reading a superblock spins up sleeping disks and can hang on dead
+ * paths, so devices that can't be bcache are dropped beforehand using
+ * what is already known without touching them:
+ *
+ *  - SCAN_FILTER_CONF: "exclude <pattern>" never reads matching devices,
+ *    "include <pattern>" always does. Patterns are fnmatch(3) globs on
+ *    the kernel name (sda, nvme0n1p2, dm-3). Exclude wins.
+ *  - devices registered with bcache are always candidates
+ *  - devices without media (size 0), floppies, optical drives and
+ *    ram/zram disks are not
+ *  - the udev database, which holds what blkid found on each device.
+ *    Like 69-bcache.rules: ID_FS_TYPE=bcache is a candidate, any other
+ *    filesystem type is not, and neither are disks with a partition
+ *    table or dm devices udev was told to leave alone.
+ *
+ * Devices udev knows nothing about are read.
+ */
+
+#define _GNU_SOURCE
+
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysmacros.h>
+
+#include "scanfilter.h"
+
+static int add_pattern(char ***list, unsigned int *nr, const char *pattern)
+{
+	char **n;
+
+	n = realloc(*list, (*nr + 1) * sizeof(*n));
+	if (n == NULL)
+		return 1;
+	*list = n;
+	n[*nr] = strdup(pattern);
+	if (n[*nr] == NULL)
+		return 1;
+	(*nr)++;
+	return 0;
+}
+
+/* A missing configuration file is the same as an empty one */
+int scan_filter_load(struct scan_filter *filter, bool use_udev)
+{
+	char line[256], word[16], pattern[240];
+	unsigned int lineno = 0;
+	int ret = 0;
+	FILE *f;
+
+	memset(filter, 0, sizeof(*filter));
+	filter->use_udev = use_udev;
+
+	f = fopen(SCAN_FILTER_CONF, "r");
+	if (f == NULL)
+		return 0;
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if (line[strspn(line, " \t\n")] == '#' ||
+		    line[strspn(line, " \t\n")] == '\0')
+			continue;
+
+		if (sscanf(line, "%15s %239s", word, pattern) != 2) {
+			fprintf(stderr, "%s:%u: expected include|exclude <pattern>\n",
+				SCAN_FILTER_CONF, lineno);
+			ret = 1;
+			break;
+		}
+		if (!strcmp(word, "include"))
+			ret = add_pattern(&filter->include,
+					  &filter->nr_include, pattern);
+		else if (!strcmp(word, "exclude"))
+			ret = add_pattern(&filter->exclude,
+					  &filter->nr_exclude, pattern);
+		else {
+			fprintf(stderr, "%s:%u: unknown keyword %s\n",
+				SCAN_FILTER_CONF, lineno, word);
+			ret = 1;
+		}
+		if (ret)
+			break;
+	}
+	fclose(f);
+
+	if (ret)
+		scan_filter_free(filter);
+	return ret;
+}
+
+static bool match_any(char **patterns, unsigned int nr, const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++)
+		if (fnmatch(patterns[i], name, 0) == 0)
+			return true;
+	return false;
+}
+
+static bool has_prefix(const char *name, const char *prefix)
+{
+	return !strncmp(name, prefix, strlen(prefix));
+}
+
+enum udev_verdict {
+	UDEV_UNKNOWN,
+	UDEV_BCACHE,
+	UDEV_OTHER,
+};
+
+static enum udev_verdict udev_lookup(struct topo_node *node)
+{
+	enum udev_verdict verdict = UDEV_UNKNOWN;
+	char path[64], line[512];
+	FILE *f;
+
+	snprintf(path, sizeof(path), UDEV_DATA_DIR "/b%u:%u",
+		 major(node->devt), minor(node->devt));
+	f = fopen(path, "r");
+	if (f == NULL)
+		return UDEV_UNKNOWN;
+
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (!strcmp(line, "E:ID_FS_TYPE=bcache")) {
+			verdict = UDEV_BCACHE;
+			break;
+		}
+		if ((has_prefix(line, "E:ID_FS_TYPE=") &&
+		     line[strlen("E:ID_FS_TYPE=")]) ||
+		    (!node->partition &&
+		     has_prefix(line, "E:ID_PART_TABLE_TYPE=") &&
+		     line[strlen("E:ID_PART_TABLE_TYPE=")]) ||
+		    !strcmp(line, "E:DM_UDEV_DISABLE_OTHER_RULES_FLAG=1"))
+			verdict = UDEV_OTHER;
+	}
+	fclose(f);
+	return verdict;
+}
+
+bool scan_filter_candidate(struct scan_filter *filter, struct topo_node *node)
+{
+	if (match_any(filter->exclude, filter->nr_exclude, node->name))
+		return false;
+	if (match_any(filter->include, filter->nr_include, node->name))
+		return true;
+	if (node->has_bcache)
+		return true;
+
+	if (node->size == 0)
+		return false;
+	if (has_prefix(node->name, "fd") || has_prefix(node->name, "sr") ||
+	    has_prefix(node->name, "ram") || has_prefix(node->name, "zram"))
+		return false;
+
+	if (filter->use_udev && udev_lookup(node) == UDEV_OTHER)
+		return false;
+	return true;
+}
+
+void scan_filter_free(struct scan_filter *filter)
+{
+	unsigned int i;
+
+	for (i = 0; i < filter->nr_include; i++)
+		free(filter->include[i]);
+	for (i = 0; i < filter->nr_exclude; i++)
+		free(filter->exclude[i]);
+	free(filter->include);
+	free(filter->exclude);
+	memset(filter, 0, sizeof(*filter));
+}
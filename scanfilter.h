@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#ifndef _BCACHE_SCANFILTER_H
+#define _BCACHE_SCANFILTER_H
+
+#include <stdbool.h>
+
+#include "topology.h"
+
+#define SCAN_FILTER_CONF	"/etc/bcache/scan.conf"
+#define UDEV_DATA_DIR		"/run/udev/data"
+
+struct scan_filter {
+	char		**include;
+	unsigned int	nr_include;
+	char		**exclude;
+	unsigned int	nr_exclude;
+	bool		use_udev;
+};
+
+int scan_filter_load(struct scan_filter *filter, bool use_udev);
+bool scan_filter_candidate(struct scan_filter *filter,
+			   struct topo_node *node);
+void scan_filter_free(struct scan_filter *filter);
+
+#endif
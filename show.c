@@ -32,8 +32,9 @@
 #include "zoned.h"
 #include "features.h"
 #include "list.h"
+#include "show.h"
 
-int show_bdevs_detail(void)
+int show_bdevs_detail(unsigned int flags)
 {
 	struct list_head head;
 	struct dev *devs, *n;
@@ -41,7 +42,7 @@ int show_bdevs_detail(void)
 	INIT_LIST_HEAD(&head);
 	int ret;
 
-	ret = list_bdevs(&head);
+	ret = list_bdevs(&head, flags);
 	if (ret != 0) {
 		fprintf(stderr, "Failed to list devices\n");
 		return ret;
@@ -90,7 +91,7 @@ int show_bdevs_detail(void)
 }
 
 
-int show_bdevs(void)
+int show_bdevs(unsigned int flags)
 {
 	struct list_head head;
 	struct dev *devs, *n;
@@ -98,7 +99,7 @@ int show_bdevs(void)
 	INIT_LIST_HEAD(&head);
 	int ret;
 
-	ret = list_bdevs(&head);
+	ret = list_bdevs(&head, flags);
 	if (ret != 0) {
 		fprintf(stderr, "Failed to list devices\n");
 		return ret;
@@ -148,6 +149,37 @@ int show_bdevs(void)
 	return 0;
 }
 
+/* returns true and fills @zl if @devname is a zoned device */
+static bool read_zone_layout(char *devname, struct zone_layout *zl)
+{
+	int fd, ret;
+
+	fd = open(devname, O_RDONLY);
+	if (fd < 0)
+		return false;
+	ret = report_zones(fd, zl);
+	close(fd);
+	return ret == 0;
+}
+
+static void print_zone_layout(char *devname)
+{
+	struct zone_layout zl;
+
+	if (!read_zone_layout(devname, &zl))
+		return;
+	putchar('\n');
+	printf("dev.zoned.zone_size\t%" PRIu64 "\n"
+	       "dev.zoned.nr_zones\t%u\n"
+	       "dev.zoned.conventional\t%u\n"
+	       "dev.zoned.seq_required\t%u\n"
+	       "dev.zoned.seq_preferred\t%u\n"
+	       "dev.zoned.offline\t%u\n"
+	       "dev.zoned.zone0\t\t%s\n",
+	       zl.zone_size, zl.nr_zones, zl.nr_conv, zl.nr_seq_req,
+	       zl.nr_seq_pref, zl.nr_offline, zone_type_name(zl.zone0_type));
+}
+
 int detail_single(char *devname)
 {
 	struct bdev bd;
@@ -217,6 +249,7 @@ int detail_single(char *devname)
 		default:
 			putchar('\n');
 		}
+		print_zone_layout(devname);
 
 		putchar('\n');
 		printf("cset.uuid\t\t%s\n", bd.base.cset);
@@ -229,7 +262,7 @@ int detail_single(char *devname)
 		printf("sb.csum\t\t\t%" PRIX64 "\n", cd.base.csum);
 		printf("sb.version\t\t%" PRIu64, cd.base.version);
 		printf(" [cache device]\n");
-		print_cache_set_supported_feature_sets(&cd.base.sb);
+		print_cache_set_supported_feature_sets(&cd.sb);
 		putchar('\n');
 		printf("dev.label\t\t");
 		if (*cd.base.label)
@@ -248,12 +281,14 @@ int detail_single(char *devname)
 		       "dev.cache.ordered\t%s\n"
 		       "dev.cache.discard\t%s\n"
 		       "dev.cache.pos\t\t%u\n"
+		       "dev.cache.nr_in_set\t%u\n"
 		       "dev.cache.replacement\t%d",
 		       cd.first_sector,
 		       cd.cache_sectors,
 		       cd.total_sectors,
 		       cd.ordered ? "yes" : "no",
-		       cd.discard ? "yes" : "no", cd.pos, cd.replacement);
+		       cd.discard ? "yes" : "no", cd.pos, cd.sb.nr_in_set,
+		       cd.replacement);
 		switch (cd.replacement) {
 		case CACHE_REPLACEMENT_LRU:
 			printf(" [lru]\n");
@@ -267,6 +302,7 @@ int detail_single(char *devname)
 		default:
 			putchar('\n');
 		}
+		print_zone_layout(devname);
 
 		putchar('\n');
 		printf("cset.uuid\t\t%s\n", cd.base.cset);
@@ -275,3 +311,535 @@ int detail_single(char *devname)
 	}
 	return 0;
 }
+
+/*
+ * Devices grouped by cache set for `tree`: every set with an active cache
+ * device, its cache devices and the backing devices attached to it, in
+ * the order the first cache device of each set was listed. The sets are
+ * found through a hash table on the cset uuid, so grouping stays linear
+ * in the number of devices.
+ */
+struct cset_group {
+	const char	*cset;
+	struct dev	**caches;
+	unsigned int	nr_caches;
+	struct dev	**backing;
+	unsigned int	nr_backing;
+};
+
+struct cset_index {
+	struct cset_group	*groups;
+	unsigned int		nr;
+	unsigned int		*table;	/* group index + 1, 0 if free */
+	unsigned int		mask;
+};
+
+static unsigned int cset_hash(const char *cset)
+{
+	unsigned int h = 2166136261u;
+
+	for (; *cset; cset++)
+		h = (h ^ (unsigned char) *cset) * 16777619u;
+	return h;
+}
+
+/* Slot of @cset in the table, either holding it or free */
+static unsigned int *cset_slot(struct cset_index *idx, const char *cset)
+{
+	unsigned int i = cset_hash(cset) & idx->mask;
+
+	while (idx->table[i] &&
+	       strcmp(idx->groups[idx->table[i] - 1].cset, cset))
+		i = (i + 1) & idx->mask;
+	return &idx->table[i];
+}
+
+static int group_add(struct dev ***arr, unsigned int *nr, struct dev *dev)
+{
+	struct dev **n;
+
+	/* grow at every power of two */
+	if ((*nr & (*nr - 1)) == 0) {
+		n = realloc(*arr, (*nr ? *nr * 2 : 1) * sizeof(*n));
+		if (n == NULL)
+			return 1;
+		*arr = n;
+	}
+	(*arr)[(*nr)++] = dev;
+	return 0;
+}
+
+static bool is_cache(struct dev *dev)
+{
+	return dev->version == BCACHE_SB_VERSION_CDEV ||
+	       dev->version == BCACHE_SB_VERSION_CDEV_WITH_UUID ||
+	       dev->version == BCACHE_SB_VERSION_CDEV_WITH_FEATURES;
+}
+
+static bool is_active_cache(struct dev *dev)
+{
+	return is_cache(dev) &&
+	       strcmp(dev->state, BCACHE_BASIC_STATE_ACTIVE) == 0;
+}
+
+static void cset_index_free(struct cset_index *idx)
+{
+	unsigned int i;
+
+	for (i = 0; i < idx->nr; i++) {
+		free(idx->groups[i].caches);
+		free(idx->groups[i].backing);
+	}
+	free(idx->groups);
+	free(idx->table);
+}
+
+/* Cache devices of a multi-device set in the order the set numbers them */
+static void sort_members(struct cset_group *g)
+{
+	struct dev *dev;
+	unsigned int i, j;
+
+	for (i = 1; i < g->nr_caches; i++) {
+		dev = g->caches[i];
+		for (j = i; j > 0 &&
+		     g->caches[j - 1]->nr_this_dev > dev->nr_this_dev; j--)
+			g->caches[j] = g->caches[j - 1];
+		g->caches[j] = dev;
+	}
+}
+
+static int cset_index_build(struct cset_index *idx, struct list_head *head)
+{
+	struct cset_group *g;
+	unsigned int nr = 0, size = 16, *slot, i;
+	struct dev *dev;
+
+	memset(idx, 0, sizeof(*idx));
+	list_for_each_entry(dev, head, dev_list)
+		nr++;
+	while (size < nr * 2)
+		size <<= 1;
+
+	idx->mask = size - 1;
+	idx->table = calloc(size, sizeof(*idx->table));
+	idx->groups = calloc(nr ? nr : 1, sizeof(*idx->groups));
+	if (idx->table == NULL || idx->groups == NULL)
+		goto err;
+
+	list_for_each_entry(dev, head, dev_list) {
+		if (!is_active_cache(dev))
+			continue;
+		slot = cset_slot(idx, dev->cset);
+		if (*slot == 0) {
+			idx->groups[idx->nr].cset = dev->cset;
+			*slot = ++idx->nr;
+		}
+		g = &idx->groups[*slot - 1];
+		if (group_add(&g->caches, &g->nr_caches, dev))
+			goto err;
+	}
+
+	list_for_each_entry(dev, head, dev_list) {
+		if (strlen(dev->attachuuid) != 36)
+			continue;
+		slot = cset_slot(idx, dev->attachuuid);
+		if (*slot == 0)
+			continue;
+		g = &idx->groups[*slot - 1];
+		if (group_add(&g->backing, &g->nr_backing, dev))
+			goto err;
+	}
+
+	for (i = 0; i < idx->nr; i++)
+		sort_members(&idx->groups[i]);
+	return 0;
+err:
+	fprintf(stderr, "Error: fail to allocate memory buffer\n");
+	cset_index_free(idx);
+	return 1;
+}
+
+int tree(unsigned int flags)
+{
+	struct cset_index idx;
+	struct list_head head;
+	struct cset_group *g;
+	unsigned int i, j;
+	int ret;
+
+	INIT_LIST_HEAD(&head);
+	ret = list_bdevs(&head, flags);
+	if (ret != 0) {
+		fprintf(stderr, "Failed to list devices\n");
+		return ret;
+	}
+	ret = cset_index_build(&idx, &head);
+	if (ret != 0) {
+		free_dev(&head);
+		return ret;
+	}
+
+	/* Straight to stdio, which does the buffering */
+	if (idx.nr)
+		printf(".\n");
+	for (i = 0; i < idx.nr; i++) {
+		g = &idx.groups[i];
+		for (j = 0; j < g->nr_caches; j++) {
+			printf("%s", g->caches[j]->name);
+			if (g->caches[j]->nr_in_set > 1)
+				printf(" (cache %u of %u)",
+				       g->caches[j]->nr_this_dev + 1,
+				       g->caches[j]->nr_in_set);
+			putchar('\n');
+		}
+		for (j = 0; j < g->nr_backing; j++)
+			printf("%s%s %s\n",
+			       j + 1 < g->nr_backing ? "├─" : "└─",
+			       g->backing[j]->name, g->backing[j]->bname);
+	}
+
+	cset_index_free(&idx);
+	free_dev(&head);
+	return 0;
+}
+
+/*
+ * JSON output. Every device (or tree node) is one object; with
+ * SHOW_FORMAT_JSON they are elements of one array, with
+ * SHOW_FORMAT_NDJSON each is a line of its own. Sentinels of the text
+ * output ("Non-Exist", "N/A", "Alone") become null. Labels are raw
+ * bytes: UTF-8 in them is passed through, control characters are
+ * escaped and bytes that aren't valid UTF-8 become U+FFFD.
+ */
+struct json_out {
+	enum show_format	format;
+	bool			more;
+	unsigned int		nr;
+};
+
+/* Length of the well-formed UTF-8 sequence at @s, 0 if there is none */
+static size_t utf8_len(const unsigned char *s)
+{
+	unsigned char lo = 0x80, hi = 0xbf;
+	size_t len, i;
+
+	if (s[0] < 0x80)
+		return 1;
+	if (s[0] >= 0xc2 && s[0] <= 0xdf)
+		len = 2;
+	else if (s[0] >= 0xe0 && s[0] <= 0xef)
+		len = 3;
+	else if (s[0] >= 0xf0 && s[0] <= 0xf4)
+		len = 4;
+	else
+		return 0;
+
+	/* no overlong forms, surrogates or code points past U+10FFFF */
+	if (s[0] == 0xe0)
+		lo = 0xa0;
+	else if (s[0] == 0xed)
+		hi = 0x9f;
+	else if (s[0] == 0xf0)
+		lo = 0x90;
+	else if (s[0] == 0xf4)
+		hi = 0x8f;
+	if (s[1] < lo || s[1] > hi)
+		return 0;
+	for (i = 2; i < len; i++)
+		if (s[i] < 0x80 || s[i] > 0xbf)
+			return 0;
+	return len;
+}
+
+static void json_str(const char *str)
+{
+	const unsigned char *s = (const unsigned char *) str;
+	size_t len;
+
+	putchar('"');
+	while (*s) {
+		if (*s == '"' || *s == '\\') {
+			printf("\\%c", *s);
+			s++;
+		} else if (*s < 0x20 || *s == 0x7f) {
+			printf("\\u%04x", *s);
+			s++;
+		} else if ((len = utf8_len(s)) != 0) {
+			fwrite(s, 1, len, stdout);
+			s += len;
+		} else {
+			printf("\\ufffd");
+			s++;
+		}
+	}
+	putchar('"');
+}
+
+/* A string, or null for the placeholders of the text output */
+static void json_str_or_null(const char *s)
+{
+	if (!strcmp(s, BCACHE_BNAME_NOT_EXIST) ||
+	    !strcmp(s, BCACHE_NO_SUPPORT) ||
+	    !strcmp(s, BCACHE_ATTACH_ALONE))
+		printf("null");
+	else
+		json_str(s);
+}
+
+static const char *dev_type_name(uint64_t version)
+{
+	switch (version) {
+	case BCACHE_SB_VERSION_CDEV:
+	case BCACHE_SB_VERSION_CDEV_WITH_UUID:
+	case BCACHE_SB_VERSION_CDEV_WITH_FEATURES:
+		return "cache";
+	case BCACHE_SB_VERSION_BDEV:
+	case BCACHE_SB_VERSION_BDEV_WITH_OFFSET:
+	case BCACHE_SB_VERSION_BDEV_WITH_FEATURES:
+		return "data";
+	default:
+		return "unknown";
+	}
+}
+
+static void json_begin_record(struct json_out *out)
+{
+	if (out->format == SHOW_FORMAT_JSON)
+		printf(out->nr ? ",\n" : "[\n");
+	out->nr++;
+}
+
+static void json_end_record(struct json_out *out)
+{
+	if (out->format == SHOW_FORMAT_NDJSON) {
+		putchar('\n');
+		/* let consumers see each device as soon as it is found */
+		fflush(stdout);
+	}
+}
+
+static void json_end(struct json_out *out)
+{
+	if (out->format != SHOW_FORMAT_JSON)
+		return;
+	printf(out->nr ? "\n]\n" : "[]\n");
+}
+
+/* The paths of a multipath device, from its comma separated list */
+static void json_print_paths(const char *paths)
+{
+	char name[sizeof(((struct dev *) 0)->paths)];
+	size_t len;
+	bool first = true;
+
+	printf(",\"paths\":[");
+	while (*paths) {
+		len = strcspn(paths, ",");
+		memcpy(name, paths, len);
+		name[len] = '\0';
+		if (!first)
+			putchar(',');
+		json_str(name);
+		first = false;
+		paths += len + (paths[len] == ',');
+	}
+	putchar(']');
+}
+
+static int json_print_dev(struct dev *dev, void *arg)
+{
+	struct json_out *out = arg;
+
+	json_begin_record(out);
+	printf("{\"device\":");
+	json_str(dev->name);
+	printf(",\"type\":\"%s\",\"sb_version\":%" PRIu64,
+	       dev_type_name(dev->version), dev->version);
+	if (out->more) {
+		printf(",\"uuid\":");
+		json_str(dev->uuid);
+		printf(",\"cset_uuid\":");
+		json_str(dev->cset);
+		if (is_cache(dev))
+			printf(",\"nr_in_set\":%u,\"nr_this_dev\":%u",
+			       dev->nr_in_set, dev->nr_this_dev);
+	}
+	printf(",\"state\":");
+	json_str(dev->state);
+	printf(",\"bname\":");
+	json_str_or_null(dev->bname);
+	printf(",\"attached_cset\":");
+	if (strlen(dev->attachuuid) == 36)
+		json_str(dev->attachuuid);
+	else
+		printf("null");
+	if (dev->paths[0])
+		json_print_paths(dev->paths);
+	putchar('}');
+	json_end_record(out);
+	return 0;
+}
+
+/* show and show -m: one record per device, as the scan finds them */
+int show_bdevs_json(unsigned int flags, enum show_format format, bool more)
+{
+	struct json_out out = { .format = format, .more = more };
+	struct list_head head;
+	int ret;
+
+	INIT_LIST_HEAD(&head);
+	ret = list_bdevs_stream(&head, flags, json_print_dev, &out);
+	if (ret != 0) {
+		/* leave the array open, a truncated document doesn't parse */
+		if (out.nr)
+			putchar('\n');
+		fflush(stdout);
+		fprintf(stderr, "Failed to list devices\n");
+		return ret;
+	}
+	json_end(&out);
+	free_dev(&head);
+	return 0;
+}
+
+static void json_print_base(struct dev *base)
+{
+	printf("{\"device\":");
+	json_str(base->name);
+	printf(",\"sb\":{\"magic\":");
+	json_str(base->magic);
+	printf(",\"first_sector\":%" PRIu64 ",\"csum\":\"%" PRIX64 "\""
+	       ",\"version\":%" PRIu64 ",\"type\":\"%s\"}",
+	       base->first_sector, base->csum, base->version,
+	       dev_type_name(base->version));
+	printf(",\"dev\":{\"label\":");
+	json_str(base->label);
+	printf(",\"uuid\":");
+	json_str(base->uuid);
+	printf(",\"sectors_per_block\":%u,\"sectors_per_bucket\":%u",
+	       base->sectors_per_block, base->sectors_per_bucket);
+}
+
+static void json_print_zones(char *devname)
+{
+	struct zone_layout zl;
+
+	if (!read_zone_layout(devname, &zl))
+		return;
+	printf(",\"zones\":{\"zone_size\":%" PRIu64 ",\"nr_zones\":%u"
+	       ",\"conventional\":%u,\"seq_required\":%u"
+	       ",\"seq_preferred\":%u,\"offline\":%u,\"zone0\":",
+	       zl.zone_size, zl.nr_zones, zl.nr_conv, zl.nr_seq_req,
+	       zl.nr_seq_pref, zl.nr_offline);
+	json_str(zone_type_name(zl.zone0_type));
+	putchar('}');
+}
+
+/* show -d */
+int detail_single_json(char *devname, enum show_format format)
+{
+	struct json_out out = { .format = format };
+	struct bdev bd;
+	struct cdev cd;
+	int type = 1;
+	int ret;
+
+	ret = detail_dev(devname, &bd, &cd, &type);
+	if (ret != 0) {
+		fprintf(stderr, "Failed to detail device\n");
+		return ret;
+	}
+
+	if (type == BCACHE_SB_VERSION_BDEV ||
+	    type == BCACHE_SB_VERSION_BDEV_WITH_OFFSET ||
+	    type == BCACHE_SB_VERSION_BDEV_WITH_FEATURES) {
+		json_begin_record(&out);
+		json_print_base(&bd.base);
+		printf(",\"data\":{\"first_sector\":%u,\"cache_mode\":%d"
+		       ",\"cache_state\":%u}}",
+		       bd.first_sector, bd.cache_mode, bd.cache_state);
+		json_print_zones(devname);
+		printf(",\"cset\":{\"uuid\":");
+		json_str(bd.base.cset);
+		printf("}}");
+	} else if (type == BCACHE_SB_VERSION_CDEV ||
+		   type == BCACHE_SB_VERSION_CDEV_WITH_UUID ||
+		   type == BCACHE_SB_VERSION_CDEV_WITH_FEATURES) {
+		json_begin_record(&out);
+		json_print_base(&cd.base);
+		printf(",\"cache\":{\"first_sector\":%u"
+		       ",\"cache_sectors\":%" PRIu64
+		       ",\"total_sectors\":%" PRIu64
+		       ",\"ordered\":%s,\"discard\":%s,\"pos\":%u"
+		       ",\"nr_in_set\":%u,\"nr_this_dev\":%u"
+		       ",\"replacement\":%u}}",
+		       cd.first_sector, cd.cache_sectors, cd.total_sectors,
+		       cd.ordered ? "true" : "false",
+		       cd.discard ? "true" : "false",
+		       cd.pos, cd.sb.nr_in_set, cd.sb.nr_this_dev,
+		       cd.replacement);
+		json_print_zones(devname);
+		printf(",\"cset\":{\"uuid\":");
+		json_str(cd.base.cset);
+		printf("}}");
+	} else {
+		return 1;
+	}
+	json_end_record(&out);
+	json_end(&out);
+	return 0;
+}
+
+/* tree: one record per cache set with its cache and backing devices */
+int tree_json(unsigned int flags, enum show_format format)
+{
+	struct json_out out = { .format = format };
+	struct cset_index idx;
+	struct list_head head;
+	struct cset_group *g;
+	unsigned int i, j;
+	int ret;
+
+	INIT_LIST_HEAD(&head);
+	ret = list_bdevs(&head, flags);
+	if (ret != 0) {
+		fprintf(stderr, "Failed to list devices\n");
+		return ret;
+	}
+	ret = cset_index_build(&idx, &head);
+	if (ret != 0) {
+		free_dev(&head);
+		return ret;
+	}
+
+	for (i = 0; i < idx.nr; i++) {
+		g = &idx.groups[i];
+		json_begin_record(&out);
+		printf("{\"cache\":");
+		json_str(g->caches[0]->name);
+		printf(",\"caches\":[");
+		for (j = 0; j < g->nr_caches; j++) {
+			if (j)
+				putchar(',');
+			json_str(g->caches[j]->name);
+		}
+		printf("],\"nr_in_set\":%u,\"cset_uuid\":",
+		       g->caches[0]->nr_in_set);
+		json_str(g->cset);
+		printf(",\"backing\":[");
+		for (j = 0; j < g->nr_backing; j++) {
+			printf(j ? ",{\"device\":" : "{\"device\":");
+			json_str(g->backing[j]->name);
+			printf(",\"bname\":");
+			json_str_or_null(g->backing[j]->bname);
+			putchar('}');
+		}
+		printf("]}");
+		json_end_record(&out);
+	}
+	json_end(&out);
+	cset_index_free(&idx);
+	free_dev(&head);
+	return 0;
+}
@@ -3,8 +3,20 @@
 #ifndef _BCH_MAKE_H
 #define _BCH_MAKE_H
 
-int show_bdevs_detail(void);
-int show_bdevs(void);
+#include <stdbool.h>
+
+enum show_format {
+	SHOW_FORMAT_TEXT,
+	SHOW_FORMAT_JSON,
+	SHOW_FORMAT_NDJSON,
+};
+
+int show_bdevs_detail(unsigned int flags);
+int show_bdevs(unsigned int flags);
 int detail_single(char *devname);
+int tree(unsigned int flags);
+int show_bdevs_json(unsigned int flags, enum show_format format, bool more);
+int detail_single_json(char *devname, enum show_format format);
+int tree_json(unsigned int flags, enum show_format format);
 
 #endif
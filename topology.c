@@ -0,0 +1,402 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * One-pass snapshot of the block device topology in sysfs.
+ *
+ * Listing devices used to look up every attribute of every device on its
+ * own, each lookup rescanning /sys/block to find where the device lives.
+ * Instead, /sys/block and /sys/fs/bcache are walked once per invocation
+ * with directory file descriptors, and everything listing needs (disks
+ * and their partitions, bcache state, the cache/dev symlinks, multipath
+ * relations and which cache sets are registered) is answered from memory
+ * afterwards.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "bcache.h"
+#include "lib.h"
+#include "topology.h"
+
+static struct topo_node *topo_add_node(struct topology *topo)
+{
+	struct topo_node *node;
+
+	if (topo->nr == topo->alloc) {
+		unsigned int alloc = topo->alloc ? topo->alloc * 2 : 64;
+
+		node = realloc(topo->nodes, alloc * sizeof(*node));
+		if (node == NULL)
+			return NULL;
+		topo->nodes = node;
+		topo->alloc = alloc;
+	}
+
+	node = &topo->nodes[topo->nr++];
+	memset(node, 0, sizeof(*node));
+	strcpy(node->state, BCACHE_BASIC_STATE_INACTIVE);
+	strcpy(node->bname, BCACHE_BNAME_NOT_EXIST);
+	strcpy(node->attachuuid, BCACHE_BNAME_NOT_EXIST);
+	return node;
+}
+
+/* Read a one line sysfs attribute below @dirfd, without the newline */
+static int read_attr(int dirfd, const char *attr, char *buf, size_t size)
+{
+	ssize_t ret;
+	int fd;
+
+	fd = openat(dirfd, attr, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	ret = read(fd, buf, size - 1);
+	close(fd);
+	if (ret < 0)
+		return -1;
+	buf[ret] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+static uint64_t read_attr_u64(int dirfd, const char *attr)
+{
+	char buf[32];
+
+	if (read_attr(dirfd, attr, buf, sizeof(buf)))
+		return 0;
+	return strtoull(buf, NULL, 10);
+}
+
+/* Identity of the device, used to key the superblock cache */
+static void topo_read_id(struct topo_node *node, int dirfd)
+{
+	unsigned int major, minor;
+	char buf[32];
+
+	if (read_attr(dirfd, "dev", buf, sizeof(buf)) == 0 &&
+	    sscanf(buf, "%u:%u", &major, &minor) == 2)
+		node->devt = makedev(major, minor);
+	node->size = read_attr_u64(dirfd, "size");
+}
+
+static void read_link_tail(int dirfd, const char *attr, char *dest,
+			   size_t size, size_t tail)
+{
+	char link[PATH_MAX];
+	ssize_t ret;
+	char *p;
+
+	ret = readlinkat(dirfd, attr, link, sizeof(link) - 1);
+	if (ret < 0)
+		return;
+	link[ret] = '\0';
+
+	if (tail) {
+		/* the last @tail characters, e.g. a cache set uuid */
+		if (ret < tail)
+			return;
+		p = link + ret - tail;
+	} else {
+		p = strrchr(link, '/');
+		p = p ? p + 1 : link;
+	}
+	if (strlen(p) < size)
+		strcpy(dest, p);
+}
+
+/* Mirrors get_backdev_state(), get_dev_bname() and get_backdev_attachpoint() */
+static void topo_read_bcache(struct topo_node *node, int dirfd)
+{
+	char running[20];
+
+	if (faccessat(dirfd, "bcache", F_OK, 0))
+		return;
+	node->has_bcache = true;
+
+	if (read_attr(dirfd, "bcache/state", node->state,
+		      sizeof(node->state)) == 0 &&
+	    read_attr(dirfd, "bcache/running", running,
+		      sizeof(running)) == 0 &&
+	    running[0] == '1')
+		strcat(node->state, "(running)");
+
+	read_link_tail(dirfd, "bcache/dev", node->bname,
+		       sizeof(node->bname), 0);
+	read_link_tail(dirfd, "bcache/cache", node->attachuuid,
+		       sizeof(node->attachuuid), 36);
+}
+
+static int topo_scan_disk(struct topology *topo, int blockfd,
+			  const char *name)
+{
+	struct topo_node *node;
+	struct dirent *ptr;
+	char path[PATH_MAX];
+	int diskfd, partfd;
+	uint64_t diskseq;
+	DIR *dir;
+
+	diskfd = openat(blockfd, name, O_RDONLY | O_DIRECTORY);
+	if (diskfd < 0)
+		return 1;
+	/* Only exists since Linux 5.15, partitions share their disk's */
+	diskseq = read_attr_u64(diskfd, "diskseq");
+	dir = fdopendir(dup(diskfd));
+	if (dir == NULL) {
+		close(diskfd);
+		return 1;
+	}
+
+	/*
+	 * Partitions come before their disk, in the order the old listing
+	 * code returned them.
+	 */
+	while ((ptr = readdir(dir)) != NULL) {
+		if (ptr->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/partition", ptr->d_name);
+		if (faccessat(diskfd, path, F_OK, 0))
+			continue;
+
+		node = topo_add_node(topo);
+		if (node == NULL)
+			goto err;
+		snprintf(node->name, sizeof(node->name), "%s", ptr->d_name);
+		snprintf(node->location, sizeof(node->location), "%s/%s",
+			 name, ptr->d_name);
+		node->partition = true;
+
+		node->diskseq = diskseq;
+
+		partfd = openat(diskfd, ptr->d_name, O_RDONLY | O_DIRECTORY);
+		if (partfd >= 0) {
+			topo_read_id(node, partfd);
+			node->start = read_attr_u64(partfd, "start");
+			topo_read_bcache(node, partfd);
+			close(partfd);
+		}
+	}
+
+	node = topo_add_node(topo);
+	if (node == NULL)
+		goto err;
+	snprintf(node->name, sizeof(node->name), "%s", name);
+	snprintf(node->location, sizeof(node->location), "%s", name);
+	node->diskseq = diskseq;
+	topo_read_id(node, diskfd);
+	topo_read_bcache(node, diskfd);
+
+	closedir(dir);
+	close(diskfd);
+	return 0;
+err:
+	closedir(dir);
+	close(diskfd);
+	return 1;
+}
+
+struct mpath_minor {
+	unsigned int	minor;
+	unsigned int	node;
+};
+
+static int mpath_minor_cmp(const void *a, const void *b)
+{
+	const struct mpath_minor *x = a, *y = b;
+
+	return x->minor < y->minor ? -1 : x->minor > y->minor;
+}
+
+/* Mark @i and the partitions listed right before it as an mpath path */
+static void topo_mark_path(struct topology *topo, unsigned int i,
+			   struct topo_node *mpath)
+{
+	struct topo_node *disk = &topo->nodes[i];
+	size_t len = strlen(disk->name);
+	size_t used = strlen(mpath->paths);
+
+	disk->mpath_path = true;
+	while (i-- > 0 && topo->nodes[i].partition &&
+	       !strncmp(topo->nodes[i].location, disk->name, len) &&
+	       topo->nodes[i].location[len] == '/')
+		topo->nodes[i].mpath_path = true;
+
+	if (used + !!used + len < sizeof(mpath->paths))
+		sprintf(mpath->paths + used, "%s%s", used ? "," : "",
+			disk->name);
+}
+
+/*
+ * On SAN hosts one LUN shows up as several sdX paths below a dm device
+ * whose uuid starts with "mpath-". The paths are found through their
+ * holders directories and marked, so that each LUN is only read once,
+ * through the dm device, which lists its paths.
+ */
+static int topo_scan_mpath(struct topology *topo, int blockfd)
+{
+	struct mpath_minor *minors = NULL, key, *m;
+	unsigned int i, nr = 0;
+	struct topo_node *node;
+	struct dirent *ptr;
+	char path[PATH_MAX], uuid[160];
+	int fd;
+	DIR *dir;
+
+	for (i = 0; i < topo->nr; i++) {
+		node = &topo->nodes[i];
+		if (node->partition || strncmp(node->name, "dm-", 3))
+			continue;
+		snprintf(path, sizeof(path), "%s/dm/uuid", node->name);
+		if (read_attr(blockfd, path, uuid, sizeof(uuid)) ||
+		    strncmp(uuid, "mpath-", 6))
+			continue;
+		node->mpath = true;
+
+		m = realloc(minors, (nr + 1) * sizeof(*m));
+		if (m == NULL) {
+			free(minors);
+			return 1;
+		}
+		minors = m;
+		minors[nr].minor = minor(node->devt);
+		minors[nr++].node = i;
+	}
+	if (nr == 0)
+		return 0;
+	qsort(minors, nr, sizeof(*minors), mpath_minor_cmp);
+
+	for (i = 0; i < topo->nr; i++) {
+		node = &topo->nodes[i];
+		if (node->partition || node->mpath)
+			continue;
+		snprintf(path, sizeof(path), "%s/holders", node->name);
+		fd = openat(blockfd, path, O_RDONLY | O_DIRECTORY);
+		if (fd < 0)
+			continue;
+		dir = fdopendir(fd);
+		if (dir == NULL) {
+			close(fd);
+			continue;
+		}
+		while ((ptr = readdir(dir)) != NULL) {
+			if (sscanf(ptr->d_name, "dm-%u", &key.minor) != 1)
+				continue;
+			m = bsearch(&key, minors, nr, sizeof(*minors),
+				    mpath_minor_cmp);
+			if (m) {
+				topo_mark_path(topo, i, &topo->nodes[m->node]);
+				break;
+			}
+		}
+		closedir(dir);
+	}
+	free(minors);
+	return 0;
+}
+
+static int topo_scan_csets(struct topology *topo)
+{
+	struct dirent *ptr;
+	DIR *dir;
+
+	dir = opendir("/sys/fs/bcache");
+	if (dir == NULL)
+		return 0;	/* module not loaded, nothing registered */
+
+	while ((ptr = readdir(dir)) != NULL) {
+		if (strlen(ptr->d_name) != 36)
+			continue;
+		if (topo->nr_csets == topo->alloc_csets) {
+			unsigned int alloc = topo->alloc_csets ?
+					     topo->alloc_csets * 2 : 8;
+			char (*csets)[40];
+
+			csets = realloc(topo->csets, alloc * sizeof(*csets));
+			if (csets == NULL) {
+				closedir(dir);
+				return 1;
+			}
+			topo->csets = csets;
+			topo->alloc_csets = alloc;
+		}
+		strcpy(topo->csets[topo->nr_csets++], ptr->d_name);
+	}
+	closedir(dir);
+	return 0;
+}
+
+int topo_scan(struct topology *topo)
+{
+	struct dirent *ptr;
+	int blockfd;
+	DIR *dir;
+
+	memset(topo, 0, sizeof(*topo));
+
+	blockfd = open("/sys/block", O_RDONLY | O_DIRECTORY);
+	if (blockfd < 0) {
+		fprintf(stderr, "Unable to open dir /sys/block\n");
+		return 1;
+	}
+	dir = fdopendir(dup(blockfd));
+	if (dir == NULL) {
+		fprintf(stderr, "Unable to open dir /sys/block\n");
+		close(blockfd);
+		return 1;
+	}
+
+	while ((ptr = readdir(dir)) != NULL) {
+		if (ptr->d_name[0] == '.')
+			continue;
+		if (topo_scan_disk(topo, blockfd, ptr->d_name)) {
+			fprintf(stderr, "Unable to scan /sys/block/%s\n",
+				ptr->d_name);
+			goto err;
+		}
+	}
+	if (topo_scan_mpath(topo, blockfd)) {
+		fprintf(stderr, "Error: fail to allocate memory buffer\n");
+		goto err;
+	}
+	closedir(dir);
+	close(blockfd);
+
+	if (topo_scan_csets(topo)) {
+		fprintf(stderr, "Error: fail to allocate memory buffer\n");
+		topo_free(topo);
+		return 1;
+	}
+	return 0;
+err:
+	closedir(dir);
+	close(blockfd);
+	topo_free(topo);
+	return 1;
+}
+
+void topo_free(struct topology *topo)
+{
+	free(topo->nodes);
+	free(topo->csets);
+	memset(topo, 0, sizeof(*topo));
+}
+
+bool topo_cset_active(struct topology *topo, const char *cset)
+{
+	unsigned int i;
+
+	for (i = 0; i < topo->nr_csets; i++)
+		if (!strcmp(topo->csets[i], cset))
+			return true;
+	return false;
+}
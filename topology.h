@@ -0,0 +1,41 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#ifndef _BCACHE_TOPOLOGY_H
+#define _BCACHE_TOPOLOGY_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct topo_node {
+	char		name[NAME_MAX + 1];
+	char		location[2 * NAME_MAX + 2];	/* below /sys/block */
+	dev_t		devt;
+	uint64_t	diskseq;	/* of the whole disk, 0 if unknown */
+	uint64_t	start;		/* partitions only, in sectors */
+	uint64_t	size;		/* in sectors */
+	bool		partition;
+	bool		has_bcache;
+	bool		mpath;		/* dm-multipath device */
+	bool		mpath_path;	/* one path of an mpath device */
+	char		paths[128];	/* mpath only, comma separated */
+	char		state[40];
+	char		bname[40];
+	char		attachuuid[40];
+};
+
+struct topology {
+	struct topo_node	*nodes;
+	unsigned int		nr;
+	unsigned int		alloc;
+	char			(*csets)[40];	/* registered in /sys/fs/bcache */
+	unsigned int		nr_csets;
+	unsigned int		alloc_csets;
+};
+
+int topo_scan(struct topology *topo);
+void topo_free(struct topology *topo);
+bool topo_cset_active(struct topology *topo, const char *cset);
+
+#endif
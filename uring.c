@@ -0,0 +1,230 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Minimal io_uring wrapper for batched reads, talking to the kernel
+ * through the raw system calls so that no liburing is needed.
+ *
+ * Only what device discovery needs is here: queue a number of reads,
+ * submit them with one system call, and reap completions in whatever
+ * order the devices answer.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+struct uring {
+	int			fd;
+	unsigned int		entries;
+	unsigned int		to_submit;
+
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_mask;
+	unsigned int		*sq_array;
+	struct io_uring_sqe	*sqes;
+	struct iovec		*iovecs;
+
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		*cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	void			*sq_ring;
+	size_t			sq_ring_size;
+	void			*cq_ring;
+	size_t			cq_ring_size;
+	size_t			sqes_size;
+};
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+			      unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+/*
+ * Returns NULL when io_uring can't be used (old kernel, disabled by
+ * sysctl or seccomp, out of memory), callers fall back to plain pread().
+ */
+struct uring *uring_setup(unsigned int entries)
+{
+	struct io_uring_params p;
+	struct uring *ring;
+
+	ring = calloc(1, sizeof(*ring));
+	if (ring == NULL)
+		return NULL;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = sys_io_uring_setup(entries, &p);
+	if (ring->fd < 0) {
+		free(ring);
+		return NULL;
+	}
+	ring->entries = p.sq_entries;
+
+	ring->sq_ring_size = p.sq_off.array +
+			     p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = p.cq_off.cqes +
+			     p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = 0;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto err_close;
+
+	if (ring->cq_ring_size) {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto err_sq;
+	} else {
+		ring->cq_ring = ring->sq_ring;
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd,
+			  IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto err_cq;
+
+	ring->iovecs = calloc(p.sq_entries, sizeof(*ring->iovecs));
+	if (ring->iovecs == NULL)
+		goto err_sqes;
+
+	ring->sq_head = ring->sq_ring + p.sq_off.head;
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ring + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + p.sq_off.array;
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ring + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+	return ring;
+
+err_sqes:
+	munmap(ring->sqes, ring->sqes_size);
+err_cq:
+	if (ring->cq_ring_size)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+err_sq:
+	munmap(ring->sq_ring, ring->sq_ring_size);
+err_close:
+	close(ring->fd);
+	free(ring);
+	return NULL;
+}
+
+void uring_exit(struct uring *ring)
+{
+	free(ring->iovecs);
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring_size)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	free(ring);
+}
+
+unsigned int uring_entries(struct uring *ring)
+{
+	return ring->entries;
+}
+
+/*
+ * Queue a read of @len bytes at @offset into @buf, returns -1 if the
+ * submission queue is full. IORING_OP_READV is used rather than
+ * IORING_OP_READ because it exists since the first io_uring kernel.
+ */
+int uring_prep_read(struct uring *ring, int fd, void *buf, size_t len,
+		    uint64_t offset, uint64_t user_data)
+{
+	unsigned int tail = *ring->sq_tail;
+	unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned int idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+	if (tail - head >= ring->entries)
+		return -1;
+
+	ring->iovecs[idx].iov_base = buf;
+	ring->iovecs[idx].iov_len = len;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = fd;
+	sqe->off = offset;
+	sqe->addr = (unsigned long) &ring->iovecs[idx];
+	sqe->len = 1;
+	sqe->user_data = user_data;
+
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+	return 0;
+}
+
+/* Hand every queued read to the kernel in one go */
+int uring_submit(struct uring *ring)
+{
+	int ret;
+
+	while (ring->to_submit) {
+		ret = sys_io_uring_enter(ring->fd, ring->to_submit, 0, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		ring->to_submit -= ret;
+	}
+	return 0;
+}
+
+/* Wait for the next completion, in whatever order they finish */
+int uring_wait(struct uring *ring, uint64_t *user_data, int *res)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+
+	for (;;) {
+		head = *ring->cq_head;
+		if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+			break;
+		if (sys_io_uring_enter(ring->fd, 0, 1,
+				       IORING_ENTER_GETEVENTS) < 0 &&
+		    errno != EINTR)
+			return -1;
+	}
+
+	cqe = &ring->cqes[head & *ring->cq_mask];
+	*user_data = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#ifndef _BCACHE_URING_H
+#define _BCACHE_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct uring;
+
+struct uring *uring_setup(unsigned int entries);
+void uring_exit(struct uring *ring);
+unsigned int uring_entries(struct uring *ring);
+int uring_prep_read(struct uring *ring, int fd, void *buf, size_t len,
+		    uint64_t offset, uint64_t user_data);
+int uring_submit(struct uring *ring);
+int uring_wait(struct uring *ring, uint64_t *user_data, int *res);
+
+#endif
@@ -7,48 +7,185 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/blkzoned.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <libgen.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
 
 #include "bcache.h"
+#include "zoned.h"
+
+/* Zones asked for per BLKREPORTZONE call */
+#define REPORT_ZONES_BATCH	1024
+
+static const char * const zone_types[] = {
+	[BLK_ZONE_TYPE_CONVENTIONAL]	= "conventional",
+	[BLK_ZONE_TYPE_SEQWRITE_REQ]	= "sequential write required",
+	[BLK_ZONE_TYPE_SEQWRITE_PREF]	= "sequential write preferred",
+};
+
+const char *zone_type_name(unsigned int type)
+{
+	if (type < sizeof(zone_types) / sizeof(zone_types[0]) &&
+	    zone_types[type])
+		return zone_types[type];
+	return "unknown";
+}
 
 /*
- * copied and modified from zonefs_get_dev_capacity() of
- * zonefs-tools.
- * returns   0: zone size 0 indicates a non-zoned device
- *         > 0: actual zone size of the zoned device
+ * Fill @zl from the zone report of @fd.
+ * returns   0: @fd is a zoned device
+ *           1: @fd is not zoned, or not a block device
+ *          -1: the zones couldn't be reported
  */
-static size_t get_zone_size(char *devname)
+int report_zones(int fd, struct zone_layout *zl)
 {
-	char str[128];
-	FILE *file;
-	int res;
-	size_t zone_size = 0;
+	struct blk_zone_report *rep;
+	struct blk_zone *z;
+	uint64_t sector = 0;
+	unsigned int zone_size = 0, i;
+	int ret = 0;
 
-	snprintf(str, sizeof(str),
-		"/sys/block/%s/queue/chunk_sectors",
-		basename(devname));
-	file = fopen(str, "r");
-	if (!file)
-		goto out;
+	memset(zl, 0, sizeof(*zl));
+	if (ioctl(fd, BLKGETZONESZ, &zone_size) || !zone_size)
+		return 1;
+	zl->zone_size = zone_size;
 
-	memset(str, 0, sizeof(str));
-	res = fscanf(file, "%s", str);
-	fclose(file);
+	rep = malloc(sizeof(*rep) +
+		     REPORT_ZONES_BATCH * sizeof(struct blk_zone));
+	if (rep == NULL)
+		return -1;
 
-	if (res != 1)
-		goto out;
+	for (;;) {
+		memset(rep, 0, sizeof(*rep));
+		rep->sector = sector;
+		rep->nr_zones = REPORT_ZONES_BATCH;
+		if (ioctl(fd, BLKREPORTZONE, rep)) {
+			ret = -1;
+			break;
+		}
+		if (!rep->nr_zones)
+			break;
 
-	zone_size = atol(str);
+		for (i = 0; i < rep->nr_zones; i++) {
+			z = &rep->zones[i];
+			if (!zl->nr_zones) {
+				zl->zone0_type = z->type;
+				zl->zone0_cond = z->cond;
+			}
+			zl->nr_zones++;
+
+			switch (z->type) {
+			case BLK_ZONE_TYPE_CONVENTIONAL:
+				zl->nr_conv++;
+				break;
+			case BLK_ZONE_TYPE_SEQWRITE_REQ:
+				zl->nr_seq_req++;
+				break;
+			case BLK_ZONE_TYPE_SEQWRITE_PREF:
+				zl->nr_seq_pref++;
+				break;
+			default:
+				zl->nr_unknown++;
+			}
+			if (z->cond == BLK_ZONE_COND_READONLY ||
+			    z->cond == BLK_ZONE_COND_OFFLINE)
+				zl->nr_offline++;
+			sector = z->start + z->len;
+		}
+	}
 
-out:
+	free(rep);
+	return ret;
+}
+
+static int report_zones_path(char *devname, struct zone_layout *zl)
+{
+	int fd, ret;
+
+	fd = open(devname, O_RDONLY);
+	if (fd < 0)
+		return 1;
+	ret = report_zones(fd, zl);
+	close(fd);
+	if (ret < 0)
+		fprintf(stderr, "Failed to report zones of %s: %s\n",
+			devname, strerror(errno));
+	return ret;
+}
+
+/* returns 0 for non-zoned devices, otherwise the zone size in sectors */
+static size_t get_zone_size(char *devname)
+{
+	unsigned int zone_size = 0;
+	int fd;
+
+	fd = open(devname, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (ioctl(fd, BLKGETZONESZ, &zone_size))
+		zone_size = 0;
+	close(fd);
 	return zone_size;
 }
 
+/*
+ * Reset the write pointer of zone 0 if it has one, so the superblock can
+ * be written from the start of the zone.
+ * returns 0 if the zone was reset, 1 if there was nothing to reset and
+ * -1 on failure.
+ */
+int reset_zone0(int fd)
+{
+	struct zone_layout zl;
+	struct blk_zone_range range;
+
+	if (report_zones(fd, &zl) ||
+	    zl.zone0_type == BLK_ZONE_TYPE_CONVENTIONAL)
+		return 1;
+
+	range.sector = 0;
+	range.nr_sectors = zl.zone_size;
+	if (ioctl(fd, BLKRESETZONE, &range))
+		return -1;
+	return 0;
+}
+
+/*
+ * The kernel rewrites the superblock of a backing device in place, so
+ * zone 0 has to take random writes: conventional, or sequential write
+ * preferred on host-aware devices.
+ */
+static int check_zone0(char *devname, struct zone_layout *zl)
+{
+	if (zl->nr_unknown) {
+		fprintf(stderr, "%s has %u zones of unknown type\n",
+			devname, zl->nr_unknown);
+		return 1;
+	}
+
+	if (zl->zone0_cond == BLK_ZONE_COND_READONLY ||
+	    zl->zone0_cond == BLK_ZONE_COND_OFFLINE) {
+		fprintf(stderr, "zone 0 of %s is read-only or offline\n",
+			devname);
+		return 1;
+	}
+
+	if (zl->zone0_type == BLK_ZONE_TYPE_SEQWRITE_REQ) {
+		fprintf(stderr,
+			"zone 0 of %s is %s, the bcache super block needs a conventional zone (%u of %u zones are conventional)\n",
+			devname, zone_type_name(zl->zone0_type),
+			zl->nr_conv, zl->nr_zones);
+		return 1;
+	}
+	return 0;
+}
+
 /*
  * Update data_offset for zoned device, if the backing
  * device is a zoned device,
@@ -57,15 +194,25 @@ out:
  * - if data_offset is specified and larger than
  *   BDEV_DATA_START_DEFAULT, then it should be a zone
  *   size aligned value.
+ * returns 0, or 1 if the device can't be used as a backing device.
  */
-void check_data_offset_for_zoned_device(char *devname,
-				       uint64_t *data_offset)
+int check_data_offset_for_zoned_device(char *devname, uint64_t *data_offset)
 {
 	uint64_t _data_offset = *data_offset;
-	size_t zone_size = get_zone_size(devname);
+	struct zone_layout zl;
+	size_t zone_size;
 
-	if (!zone_size)
-		return;
+	switch (report_zones_path(devname, &zl)) {
+	case 0:
+		break;
+	case 1:
+		return 0;
+	default:
+		return 1;
+	}
+	if (check_zone0(devname, &zl))
+		return 1;
+	zone_size = zl.zone_size;
 
 	if (!_data_offset ||
 	    (_data_offset == BDEV_DATA_START_DEFAULT &&
@@ -76,7 +223,7 @@ void check_data_offset_for_zoned_device(char *devname,
 		fprintf(stderr,
 			"data_offset %lu should be larger than zone_size %lu for zoned device %s\n",
 			_data_offset, zone_size, devname);
-		exit(EXIT_FAILURE);
+		return 1;
 	}
 
 	if (_data_offset & (zone_size - 1)) {
@@ -86,6 +233,76 @@ void check_data_offset_for_zoned_device(char *devname,
 	}
 
 	*data_offset = _data_offset;
+	return 0;
+}
+
+/*
+ * Buckets of a zoned cache device are its zones. bcache fills a bucket
+ * from its start and only rewrites it once it has been invalidated as a
+ * whole, so with one bucket per zone every zone is written sequentially
+ * and the device never has to garbage collect. Buckets smaller or larger
+ * than a zone would share or straddle zones, so any other bucket size is
+ * refused.
+ *
+ * Sequential write required zones are refused too: the superblock in
+ * zone 0 is rewritten in place on every registration, and the kernel
+ * reuses buckets without resetting their zone first.
+ *
+ * returns 0 and sets a zero *bucket_size to the zone size, or 1 if the
+ * device can't be used as a cache device.
+ */
+int check_bucket_size_for_zoned_device(char *devname,
+				       unsigned int *bucket_size)
+{
+	struct zone_layout zl;
+	size_t zone_size;
+
+	switch (report_zones_path(devname, &zl)) {
+	case 0:
+		break;
+	case 1:
+		return 0;
+	default:
+		return 1;
+	}
+	zone_size = zl.zone_size;
+
+	if (zl.nr_unknown) {
+		fprintf(stderr, "%s has %u zones of unknown type\n",
+			devname, zl.nr_unknown);
+		return 1;
+	}
+	if (zl.nr_seq_req) {
+		fprintf(stderr,
+			"%s has %u sequential write required zones, bcache can't keep the writes to them sequential\n",
+			devname, zl.nr_seq_req);
+		return 1;
+	}
+	if (zl.nr_offline) {
+		fprintf(stderr, "%s has %u read-only or offline zones\n",
+			devname, zl.nr_offline);
+		return 1;
+	}
+
+	if (zone_size & (zone_size - 1)) {
+		fprintf(stderr,
+			"zone size %lu of zoned device %s is not a power of two\n",
+			zone_size, devname);
+		return 1;
+	}
+
+	if (!*bucket_size) {
+		*bucket_size = zone_size;
+		printf("Zoned device %s detected: bucket size set to the zone size (%lu sectors).\n\n",
+		       devname, zone_size);
+	} else if (*bucket_size != zone_size) {
+		fprintf(stderr,
+			"bucket size %u is not the zone size %lu for zoned device %s\n",
+			*bucket_size, zone_size, devname);
+		return 1;
+	}
+
+	return 0;
 }
 
 int is_zoned_device(char *devname)
@@ -8,7 +8,27 @@
 #ifndef __ZONED_H
 #define __ZONED_H
 
-void check_data_offset_for_zoned_device(char *devname, uint64_t *data_offset);
+#include <stdint.h>
+
+/* What BLKREPORTZONE says about a zoned device, sizes in sectors */
+struct zone_layout {
+	uint64_t	zone_size;
+	unsigned int	nr_zones;
+	unsigned int	nr_conv;
+	unsigned int	nr_seq_req;
+	unsigned int	nr_seq_pref;
+	unsigned int	nr_unknown;
+	unsigned int	nr_offline;	/* read-only or offline */
+	uint8_t		zone0_type;
+	uint8_t		zone0_cond;
+};
+
+int report_zones(int fd, struct zone_layout *zl);
+const char *zone_type_name(unsigned int type);
+int reset_zone0(int fd);
+int check_data_offset_for_zoned_device(char *devname, uint64_t *data_offset);
+int check_bucket_size_for_zoned_device(char *devname,
+				       unsigned int *bucket_size);
 int is_zoned_device(char *devname);
 
 #endif